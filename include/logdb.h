@@ -44,8 +44,59 @@ typedef enum {
 	 *  will be taken on the database when it is opened. This means `logdb_open` will fail if the
 	 *  database is already opened by another process (regardless of whether the other process
 	 *  opened it with `LOGDB_OPEN_NOSYNC`).
+	 *  This flag overrides all of the `LOGDB_OPEN_SYNC_*` flags below.
 	 */
-	LOGDB_OPEN_NOSYNC = 2
+	LOGDB_OPEN_NOSYNC = 2,
+
+	/**
+	 * Use `fdatasync` instead of `fsync` when syncing the database and log. This skips flushing
+	 *  file metadata (such as modification times) that is not needed to read the data back.
+	 *  Falls back to `fsync` on systems that do not support `fdatasync`.
+	 */
+	LOGDB_OPEN_SYNC_DATA = 4,
+
+	/**
+	 * Start writeback of the range of the database file written by each commit (with `sync_file_range`)
+	 *  as soon as it is written, before joining the group `fdatasync`. This gets each commit's data to
+	 *  the device earlier when many writers share a sync. Implies `LOGDB_OPEN_SYNC_DATA`, which is
+	 *  what it falls back to on systems that do not support `sync_file_range`.
+	 */
+	LOGDB_OPEN_SYNC_RANGE = 8,
+
+	/**
+	 * Do not sync on every commit. Instead, a background thread syncs the database and log
+	 *  periodically (see `logdb_set_flush_interval`). A system-wide failure could cause commits made
+	 *  since the last flush to be rolled back, and, as with `LOGDB_OPEN_NOSYNC`, could leave the most
+	 *  recent of those commits with incomplete data. Unlike `LOGDB_OPEN_NOSYNC`, multiple processes may
+	 *  write to the database. Can be combined with `LOGDB_OPEN_SYNC_DATA`.
+	 */
+	LOGDB_OPEN_SYNC_PERIODIC = 16,
+
+	/**
+	 * Let each thread keep its write lease on a section of the database across commits, appending
+	 *  to that section until it is full. This skips finding and locking a section on every commit,
+	 *  but means other writers cannot use the space remaining in sections that are leased this way.
+	 */
+	LOGDB_OPEN_STICKY_LEASES = 32,
+
+	/**
+	 * Write records to the database file with direct I/O (`O_DIRECT`), bypassing the page cache.
+	 *  Commits are staged in aligned buffers and written in whole blocks, and iterators read whole
+	 *  blocks into their own buffer. This keeps logdb from filling the page cache with data that is
+	 *  written once and rarely read back, at the cost of a copy per commit. `logdb_open` fails if the
+	 *  file system does not support direct I/O. On Darwin, `F_NOCACHE` is used instead.
+	 */
+	LOGDB_OPEN_DIRECT = 64,
+
+	/**
+	 * On Linux, submit the data write and the log write of each commit to the kernel at once, as a
+	 *  chain of linked io_uring requests (the log write starts once the data write completes), rather
+	 *  than with a system call for each. Syncs are still shared with concurrent commits, and
+	 *  `LOGDB_OPEN_SYNC_RANGE` still applies. Falls back to the default path at runtime if io_uring is
+	 *  not available (e.g. on older kernels, or where it is blocked), and for commits that span several
+	 *  sections or that are made with `LOGDB_OPEN_DIRECT`.
+	 */
+	LOGDB_OPEN_IO_URING = 128
 } logdb_open_flags;
 
 /**
@@ -58,6 +109,17 @@ typedef enum {
  */
 LOGDB_API logdb_connection* logdb_open (const char* path, logdb_open_flags flags);
 
+/**
+ * Like `logdb_open`, but creates the database with sections of the given size rather than the default
+ *  of 64KB. A database is divided into sections that writers lease one at a time, with one entry in the
+ *  log for each. Larger sections (e.g. 1-4MB) mean fewer log entries and leases for bulk loading, while
+ *  smaller ones keep small databases small. The section size must be a multiple of 4KB, and at most 256MB.
+ *  It is stored in the database when it is created with `LOGDB_OPEN_CREATE`; when opening an existing
+ *  database, the size it was created with is used instead.
+ * \returns A pointer to the connection data structure, or NULL on failure.
+ */
+LOGDB_API logdb_connection* logdb_open_with_section_size (const char* path, logdb_open_flags flags, logdb_size_t section_size);
+
 /**
  * Closes a connection previously opened with `logdb_open` and frees the memory associated with it.
  *
@@ -70,6 +132,15 @@ LOGDB_API logdb_connection* logdb_open (const char* path, logdb_open_flags flags
  */
 LOGDB_API int logdb_close (logdb_connection* connection);
 
+/**
+ * Sets how often the background thread syncs a connection opened with `LOGDB_OPEN_SYNC_PERIODIC`.
+ *  A sync happens once `millis` milliseconds have passed since the last one, or once `bytes` bytes
+ *  have been committed since the last one, whichever comes first. Pass zero (0) for one of the arguments
+ *  to disable that trigger (but not both). The defaults are 100 milliseconds and 1MB.
+ * \returns Zero (0) on success, or -1 on failure (e.g. the connection was not opened with `LOGDB_OPEN_SYNC_PERIODIC`).
+ */
+LOGDB_API int logdb_set_flush_interval (logdb_connection* connection, unsigned int millis, logdb_size_t bytes);
+
 /* ITERATORS */
 
 /** An opaque data structure representing a data buffer (see BUFFERS section below). */
@@ -82,10 +153,79 @@ typedef void logdb_iter;
  * Creates a new iterator to iterate over all records in the given connection.
  *  The iterator starts before the first record; a call to `logdb_iter_next`
  *  is required to advance to the first record.
+ *
+ *  The database is read up to a section at a time, and keys and values that fit in what was read
+ *  point into it rather than being copied, so neither they nor those from `logdb_iter_mapped`
+ *  are necessarily aligned. A retained key or value keeps the block it points into alive.
  * \returns The new iterator, or NULL on failure.
  */
 LOGDB_API logdb_iter* logdb_iter_all (logdb_connection* connection);
 
+/**
+ * Like `logdb_iter_all`, but reads the database through a read-only `mmap` of the file rather than
+ *  with system calls. The keys and values it returns point straight into the mapping instead of
+ *  being copied, so full scans of large databases run at memory speed. A key or value retained
+ *  with `logdb_buffer_retain` keeps the part of the file it was read from mapped until it is freed,
+ *  even after the iterator is.
+ * \returns The new iterator, or NULL on failure.
+ */
+LOGDB_API logdb_iter* logdb_iter_mapped (logdb_connection* connection);
+
+/**
+ * Creates `count` iterators that between them iterate over all records in the given connection, each
+ *  over its own range of sections of the database, so that they can be used on different threads at once
+ *  to scan the database in parallel. The sections that exist when this is called are split evenly between
+ *  the iterators; records in sections added later are seen by the last one. Each iterator works like one
+ *  from `logdb_iter_all`, and must be freed with `logdb_iter_free`.
+ * \param connection The connection.
+ * \param count The number of iterators to create.
+ * \param iters An array of `count` pointers, which are set to the new iterators.
+ * \returns Zero (0) on success. On failure, no iterators are created.
+ */
+LOGDB_API int logdb_iter_partition (logdb_connection* connection, int count, logdb_iter** iters);
+
+/**
+ * Creates a new iterator that iterates over the records in the given connection newest first:
+ *  it starts from the last section of the database and works backwards, returning the records
+ *  in each section in the reverse of the order they were written. Reading the latest N records
+ *  thus takes time proportional to N rather than to the size of the database. Records in sections
+ *  added after the iterator is created are not seen. Like `logdb_iter_all`, a call to `logdb_iter_next`
+ *  is required to advance to the first record.
+ * \returns The new iterator, or NULL on failure.
+ */
+LOGDB_API logdb_iter* logdb_iter_reverse (logdb_connection* connection);
+
+/**
+ * Creates a new iterator that follows the database as it is written to, like `tail -f`. It starts
+ *  like one from `logdb_iter_all`, but remembers how much of each section it has read, so once
+ *  `logdb_iter_next` returns zero (0) at the end of the database, later calls return the records
+ *  committed since, wherever they were written. Use `logdb_iter_wait` to wait for those commits
+ *  rather than polling.
+ * \returns The new iterator, or NULL on failure.
+ */
+LOGDB_API logdb_iter* logdb_iter_follow (logdb_connection* connection);
+
+/**
+ * Creates a new iterator over exactly the records that had been committed when it was created.
+ *  Unlike `logdb_iter_all`, which sees some of what is committed while it runs, depending on how far it
+ *  has got, this gives a consistent view of the database for repeatable exports, while writers carry on.
+ *  The whole log is read once up front, so the scan itself doesn't go back to the log. Otherwise it works like `logdb_iter_all`.
+ * \returns The new iterator, or NULL on failure.
+ */
+LOGDB_API logdb_iter* logdb_iter_snapshot (logdb_connection* connection);
+
+/**
+ * Blocks until a commit is made to the database by any thread or process, for an iterator created
+ *  with `logdb_iter_follow` whose `logdb_iter_next` has returned zero (0). Returns right away if there
+ *  has been a commit since that call started looking for records that the call may have missed.
+ *  On Linux, this sleeps on a futex in the shared memory file; elsewhere, it polls every millisecond.
+ * \param iter The iterator.
+ * \param millis The longest time to wait in milliseconds, or -1 to wait indefinitely.
+ * \returns One (1) if records may have been committed, so `logdb_iter_next` should be called again,
+ *  zero (0) if the timeout expired first, or -1 on failure.
+ */
+LOGDB_API int logdb_iter_wait (logdb_iter* iter, int millis);
+
 /**
  * Advances the iterator to the next record.
  * \returns One (1) on success, or zero (0) on failure (e.g. there are no more records)
@@ -124,6 +264,14 @@ LOGDB_API void logdb_iter_free (logdb_iter* iter);
 /** A function pointer type representing a function to dispose a pointer. */
 typedef void (*dispose_func)(void*);
 
+/**
+ * A function pointer type for a function that is passed each fragment of data in a buffer
+ *  by `logdb_buffer_visit`. Returning nonzero stops the visit.
+ */
+typedef int (*logdb_buffer_visitor)(const void* data, logdb_size_t length, void* context);
+
+struct iovec;
+
 /**
  * Allocates a new buffer that points to the given data.
  *  The newly allocated buffer will have a reference count of one (1).
@@ -152,10 +300,35 @@ LOGDB_API logdb_size_t logdb_buffer_length (const logdb_buffer* buffer);
 /**
  * Returns a pointer to the data contained in this buffer.
  *  The data must not be modified through this pointer!
+ *  If the buffer is made of several fragments (see `logdb_buffer_append`), they are copied into
+ *  one contiguous block the first time this is called, which is kept until the buffer is freed. It is
+ *  copied again if it has grown since, i.e. if any of its fragments was appended to. Pointers returned
+ *  earlier stay valid until the buffer is freed. This is safe to call from several threads at once. To get at the data without
+ *  copying it, use `logdb_buffer_iovec` or `logdb_buffer_visit`.
  * \returns A pointer to the data, or NULL on failure.
  */
 LOGDB_API const void* logdb_buffer_data (const logdb_buffer* buffer);
 
+/**
+ * Fills in an iovec for each non-empty fragment of data in this buffer, in order, without copying
+ *  anything, so the buffer can be passed straight to `writev`. The iovecs are valid as long as the buffer is.
+ * \param buffer The buffer.
+ * \param iov An array of at least `max` iovecs.
+ * \param max The number of iovecs to fill in.
+ * \returns The number of non-empty fragments in the buffer. If this is more than `max`, only the first `max` were filled in.
+ */
+LOGDB_API int logdb_buffer_iovec (const logdb_buffer* buffer, struct iovec* iov, int max);
+
+/**
+ * Calls the given function with each non-empty fragment of data in this buffer, in order,
+ *  without copying anything.
+ * \param buffer The buffer.
+ * \param visitor The function to call.
+ * \param context Passed to `visitor`.
+ * \returns Zero (0) if every fragment was visited, otherwise the nonzero value returned by `visitor`.
+ */
+LOGDB_API int logdb_buffer_visit (const logdb_buffer* buffer, logdb_buffer_visitor visitor, void* context);
+
 /**
  * Appends the second buffer to the first buffer.
  * \param buffer1 The first buffer.
@@ -196,6 +369,19 @@ LOGDB_API int logdb_begin (logdb_connection* connection);
  */
 LOGDB_API int logdb_put (logdb_connection* connection, logdb_buffer* key, logdb_buffer* value);
 
+/**
+ * Writes the given key-value records to the database atomically, as if each of them were passed
+ *  to `logdb_put` inside a single transaction. This is more efficient than calling `logdb_put`
+ *  repeatedly, since all records are serialized into one buffer up front.
+ * \param keys An array of `count` pointers to key data. These only have to remain valid for the duration of this call.
+ * \param keylens An array of `count` key lengths.
+ * \param values An array of `count` pointers to value data. These only have to remain valid for the duration of this call.
+ * \param valuelens An array of `count` value lengths.
+ * \param count The number of records to write.
+ * \returns Zero (0) on success.
+ */
+LOGDB_API int logdb_put_batch (logdb_connection* connection, const void** keys, const logdb_size_t* keylens, const void** values, const logdb_size_t* valuelens, size_t count);
+
 /**
  * Commits the current transaction on the given connection for the current thread.
  *
@@ -210,6 +396,61 @@ LOGDB_API int logdb_put (logdb_connection* connection, logdb_buffer* key, logdb_
  */
 LOGDB_API int logdb_commit (logdb_connection* connection);
 
+/**
+ * A function pointer type for callbacks passed to `logdb_commit_async`.
+ * \param connection The connection on which the transaction was committed.
+ * \param result Zero (0) if the transaction was committed successfully.
+ * \param context The context pointer that was passed to `logdb_commit_async`.
+ */
+typedef void (*logdb_commit_callback)(logdb_connection* connection, int result, void* context);
+
+/**
+ * Commits the current transaction on the given connection for the current thread without waiting
+ *  for it to be written.
+ *
+ *  The transaction is handed to a background writer thread owned by the connection, and is no longer
+ *   the current transaction for this thread once this call returns. The writer combines transactions that
+ *   are queued together into a single write. Once the transaction has been written and synced (as far as
+ *   the flags passed to `logdb_open` allow), `callback` is called on the writer thread with the result.
+ *   Callbacks should return quickly, and must not call `logdb_close`.
+ *  If the current transaction is nested, this behaves like `logdb_commit`, except that `callback` is called
+ *   before this function returns.
+ *
+ *  If this function fails, the current transaction is left uncommitted and `callback` is not called.
+ *  `logdb_close` waits for all queued transactions to be committed.
+ * \param callback The function to call when the commit completes, or NULL.
+ * \param context An arbitrary pointer passed to `callback`.
+ * \returns Zero (0) if the transaction was queued.
+ */
+LOGDB_API int logdb_commit_async (logdb_connection* connection, logdb_commit_callback callback, void* context);
+
+/** An opaque data structure representing the pending result of an asynchronous commit. */
+typedef void logdb_future;
+
+/**
+ * Commits the current transaction on the given connection for the current thread like `logdb_commit_async`,
+ *  but returns a future that can be polled or waited on instead of calling a callback.
+ * \returns The future, which must be freed with `logdb_future_free`, or NULL if the transaction could not be queued.
+ */
+LOGDB_API logdb_future* logdb_commit_future (logdb_connection* connection);
+
+/**
+ * Checks whether the given future has completed, without blocking.
+ * \returns One (1) if the commit has completed (call `logdb_future_wait` to get its result), or zero (0) if not.
+ */
+LOGDB_API int logdb_future_poll (logdb_future* future);
+
+/**
+ * Blocks until the given future has completed.
+ * \returns Zero (0) if the transaction was committed successfully.
+ */
+LOGDB_API int logdb_future_wait (logdb_future* future);
+
+/**
+ * Frees the given future. The commit itself is not affected if it is still pending.
+ */
+LOGDB_API void logdb_future_free (logdb_future* future);
+
 /**
  * Rolls back the current transaction on the given connection for the current thread.
  *
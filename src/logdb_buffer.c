@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdatomic.h>
+#include <sys/uio.h>
 
 /**
  * Creates an unowned copy of the given buffer
@@ -39,10 +40,22 @@ logdb_buffer* logdb_buffer_new_direct (void* data, logdb_size_t length, dispose_
 	buf->disposer = disposer;
 	buf->orig = NULL;
 	buf->next = NULL;
+	buf->owner = NULL;
 	buf->refcnt = 1;
+	atomic_init (&buf->flat, NULL);
 	return buf;
 }
 
+logdb_buffer_t* logdb_buffer_new_slice (logdb_buffer_t* owner, void* data, logdb_size_t length)
+{
+	logdb_buffer_t* result = (logdb_buffer_t*)logdb_buffer_new_direct (data, length, NULL);
+	if (result) {
+		logdb_buffer_retain (owner);
+		result->owner = owner;
+	}
+	return result;
+}
+
 logdb_buffer* logdb_buffer_new_copy (void* data, logdb_size_t length)
 {
 	DBGIF(!data) {
@@ -73,6 +86,57 @@ logdb_size_t logdb_buffer_length (const logdb_buffer* buffer)
 	return len;
 }
 
+int logdb_buffer_visit (const logdb_buffer* buffer, logdb_buffer_visitor visitor, void* context)
+{
+	const logdb_buffer_t* buf = (const logdb_buffer_t*)buffer;
+	for (; buf; buf = buf->next) {
+		int result = 0;
+		if (buf->orig)
+			result = logdb_buffer_visit (buf->orig, visitor, context);
+		else if (buf->len)
+			result = visitor (buf->data, buf->len, context);
+		if (result)
+			return result;
+	}
+	return 0;
+}
+
+typedef struct {
+	struct iovec* iov;
+	int max;
+	int count;
+} logdb_buffer_iovec_state_t;
+
+static int logdb_buffer_iovec_visitor (const void* data, logdb_size_t length, void* context)
+{
+	logdb_buffer_iovec_state_t* state = (logdb_buffer_iovec_state_t*)context;
+	if (state->count < state->max) {
+		state->iov[state->count].iov_base = (void*)data;
+		state->iov[state->count].iov_len = length;
+	}
+	state->count++;
+	return 0;
+}
+
+int logdb_buffer_iovec (const logdb_buffer* buffer, struct iovec* iov, int max)
+{
+	DBGIF(!iov && max) {
+		LOG("logdb_buffer_iovec: passed iov was NULL");
+		return 0;
+	}
+	logdb_buffer_iovec_state_t state = { iov, max, 0 };
+	(void)logdb_buffer_visit (buffer, &logdb_buffer_iovec_visitor, &state);
+	return state.count;
+}
+
+static int logdb_buffer_copy_visitor (const void* data, logdb_size_t length, void* context)
+{
+	char** dataptr = (char**)context;
+	(void)memcpy (*dataptr, data, length);
+	*dataptr += length;
+	return 0;
+}
+
 const void* logdb_buffer_data (const logdb_buffer* buffer)
 {
 	logdb_buffer_t* buf = (logdb_buffer_t*)buffer;
@@ -81,47 +145,38 @@ const void* logdb_buffer_data (const logdb_buffer* buffer)
 		return NULL;
 	}
 	/* If we're just a shallow copy, return the orignal's data */
-	if (buf->orig)
+	if (buf->orig && !buf->next)
 		return logdb_buffer_data (buf->orig);
-
-	/* If we have a linked list of data, we'll need to make a copy */
-	/* FIXME: This `if` should probably be protected by a mutex. */
-	if (buf->next) {
-		logdb_size_t newlen = logdb_buffer_length (buffer);
-		void* newdata = malloc (newlen);
-		if (!newdata) {
-			ELOG("logdb_buffer_data: malloc");
-			return NULL;
+	if (!buf->next)
+		return buf->data;
+
+	/* If we have a linked list of data, we'll need to make a copy. We leave the list alone, since other
+	    threads may be reading it, and if several threads race to make the copy, only one of them keeps it.
+	    Appending to any buffer in the list (not necessarily this one) makes it longer than our copy. Since
+	    buffers are only ever appended to, a copy of the same length is still current. */
+	size_t len = logdb_buffer_length (buffer);
+	logdb_buffer_flat_t* flat = atomic_load (&buf->flat);
+	if (flat && (flat->len == len))
+		return flat->data;
+
+	logdb_buffer_flat_t* newflat = malloc (sizeof (logdb_buffer_flat_t) + len);
+	if (!newflat) {
+		ELOG("logdb_buffer_data: malloc");
+		return NULL;
+	}
+	newflat->len = len;
+	char* dataptr = newflat->data;
+	(void)logdb_buffer_visit (buffer, &logdb_buffer_copy_visitor, &dataptr);
+
+	/* An out of date copy may still be in use by whoever asked for it, so we keep it until we're freed */
+	do {
+		if (flat && (flat->len == len)) {
+			free (newflat);
+			return flat->data;
 		}
-
-		char* dataptr = (char*)newdata;
-		logdb_buffer_t* cur = buf;
-		do {
-			if (cur->orig) {
-				logdb_size_t len = logdb_buffer_length (cur->orig);
-				const void* data = logdb_buffer_data (cur->orig);
-				if (!data) {
-					free (newdata);
-					return NULL;
-				}
-				(void)memcpy (dataptr, data, len);
-				dataptr += len;
-			} else {
-				(void)memcpy (dataptr, cur->data, cur->len);
-				dataptr += cur->len;
-			}
-			cur = cur->next;
-		} while (cur);
-
-		/* Dispose the old data and use our new data instead */
-		if (buf->disposer)
-			buf->disposer (buf->data);
-		buf->data = newdata;
-		buf->len = newlen;
-		buf->next = NULL;
-		buf->disposer = &free;
-	}
-	return buf->data;
+		newflat->prev = flat;
+	} while (!atomic_compare_exchange_weak (&buf->flat, &flat, newflat));
+	return newflat->data;
 }
 
 logdb_buffer* logdb_buffer_append (logdb_buffer* buffer1, logdb_buffer* buffer2)
@@ -147,6 +202,8 @@ logdb_buffer* logdb_buffer_append (logdb_buffer* buffer1, logdb_buffer* buffer2)
 	}
 
 	buf->next = logdb_buffer_copy ((logdb_buffer_t*)buffer2);
+	if (!buf->next)
+		return NULL;
 	return buffer1;
 }
 
@@ -163,8 +220,15 @@ void logdb_buffer_free (logdb_buffer* buffer)
 		return;
 	if (buf->disposer)
 		buf->disposer (buf->data);
+	for (logdb_buffer_flat_t* flat = atomic_load (&buf->flat); flat; ) {
+		logdb_buffer_flat_t* prev = flat->prev;
+		free (flat);
+		flat = prev;
+	}
 	if (buf->orig)
 		logdb_buffer_free (buf->orig);
+	if (buf->owner)
+		logdb_buffer_free (buf->owner);
 	if (buf->next)
 		logdb_buffer_free (buf->next);
 	free (buf);
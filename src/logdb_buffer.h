@@ -5,6 +5,15 @@
 
 #include <stdatomic.h>
 
+/**
+ * Internal structure for a contiguous copy of a buffer list made by `logdb_buffer_data`.
+ */
+typedef struct logdb_buffer_flat_t {
+	struct logdb_buffer_flat_t* prev; /**< an older copy that callers may still be using, or null */
+	size_t len; /**< length of the list when the copy was made */
+	char data[];
+} logdb_buffer_flat_t;
+
 /**
  * Internal structure that is a buffer for data.
  */
@@ -14,7 +23,19 @@ typedef struct logdb_buffer_t {
 	dispose_func disposer; /**< disposer for data ptr, or null */
 	struct logdb_buffer_t* orig; /**< if this is a copy, the original buffer, or null */
 	struct logdb_buffer_t* next; /**< next buffer in the linked list, or null */
+	struct logdb_buffer_t* owner; /**< buffer whose data `data` points into, kept alive as long as this one, or null */
 	volatile atomic_int refcnt; /**< reference count */
+	volatile _Atomic(logdb_buffer_flat_t*) flat; /**< latest contiguous copy of the whole list made by `logdb_buffer_data`, or null */
 } logdb_buffer_t;
 
+/**
+ * Creates a buffer that points to part of the data owned by another buffer, without copying it.
+ *  The owner is retained until the new buffer is freed.
+ * \param owner The buffer that keeps `data` valid, e.g. by unmapping it in its disposer.
+ * \param data The data to which the new buffer should point.
+ * \param length The length of the data pointed to by the `data` pointer.
+ * \returns The new buffer, with a reference count of one (1), or NULL on failure.
+ */
+logdb_buffer_t* logdb_buffer_new_slice (logdb_buffer_t* owner, void* data, logdb_size_t length);
+
 #endif /* LOGDB_BUFFER_H */
\ No newline at end of file
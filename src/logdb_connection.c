@@ -1,6 +1,10 @@
+#ifdef __linux__
+#  define _GNU_SOURCE /* for O_DIRECT */
+#endif
 
 #include "logdb_connection.h"
 #include "logdb_txn.h"
+#include "logdb_lease.h"
 #include "logdb_io.h"
 
 #include <stdlib.h>
@@ -10,19 +14,116 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 #include <pthread.h>
 
-off_t logdb_connection_offset (logdb_size_t index)
+off_t logdb_connection_offset (const logdb_connection_t* conn, logdb_size_t index)
 {
-	return sizeof (logdb_header_t) + (index * LOGDB_SECTION_SIZE);
+	return LOGDB_SECTION_OFFSET(conn->section_size, index);
+}
+
+int logdb_connection_reserve (logdb_connection_t* conn, logdb_size_t sections)
+{
+	if (sections <= atomic_load (&conn->reserved))
+		return 0;
+
+	int result = 0;
+	pthread_mutex_lock (&conn->reserve_lock);
+	logdb_size_t reserved = atomic_load (&conn->reserved);
+	if (sections > reserved) {
+		/* Grow the file by a bunch of sections at once, so that most writes neither change
+		    its size nor allocate blocks, and syncing them doesn't have to journal that. */
+		logdb_size_t target = sections + ((LOGDB_PREALLOC_SIZE + conn->section_size - 1) / conn->section_size);
+		off_t offset = logdb_connection_offset (conn, reserved);
+		result = logdb_io_preallocate (conn->fd, offset, logdb_connection_offset (conn, target) - offset);
+		if (result == 0) {
+			VLOG("logdb_connection_reserve: preallocated sections %d-%d", reserved, target - 1);
+			atomic_store (&conn->reserved, target);
+		} else if (result == -2) {
+			/* Don't bother trying again */
+			VLOG("logdb_connection_reserve: preallocation is not supported");
+			atomic_store (&conn->reserved, UINT_MAX);
+		} else {
+			ELOG("logdb_connection_reserve: logdb_io_preallocate");
+		}
+	}
+	pthread_mutex_unlock (&conn->reserve_lock);
+	return result;
+}
+
+/**
+ * Opens another fd for the database file that bypasses the page cache, for `LOGDB_OPEN_DIRECT`.
+ * \returns The fd, or -1 on failure.
+ */
+static int logdb_connection_open_direct (const char* path)
+{
+#if defined(O_DIRECT)
+	int fd = open (path, O_RDWR | O_DIRECT);
+	if (fd == -1)
+		ELOG("logdb_open: open (O_DIRECT)");
+	return fd;
+#elif defined(F_NOCACHE)
+	int fd = open (path, O_RDWR);
+	if (fd == -1) {
+		ELOG("logdb_open: open");
+		return -1;
+	}
+	if (fcntl (fd, F_NOCACHE, 1) == -1) {
+		ELOG("logdb_open: fcntl (F_NOCACHE)");
+		close (fd);
+		return -1;
+	}
+	return fd;
+#else
+	LOG("logdb_open: LOGDB_OPEN_DIRECT is not supported on this platform");
+	return -1;
+#endif
+}
+
+/**
+ * Opens the shared memory file for the database at the given path (see `logdb_shm_open`).
+ * \returns The shared memory, or NULL on failure.
+ */
+static logdb_shm_t* logdb_connection_open_shm (const char* path, bool reset)
+{
+	size_t pathlen = strlen (path) + sizeof (LOGDB_SHM_FILE_SUFFIX);
+	char* shmpath = malloc (pathlen);
+	if (!shmpath) {
+		ELOG("logdb_open: malloc");
+		return NULL;
+	}
+	(void)strncpy (shmpath, path, pathlen);
+	(void)strcat (shmpath, LOGDB_SHM_FILE_SUFFIX);
+
+	logdb_shm_t* shm = logdb_shm_open (shmpath, reset);
+	free (shmpath);
+	return shm;
+}
+
+/**
+ * Returns true if the given section size can be used for a database.
+ */
+static bool logdb_connection_valid_section_size (logdb_size_t section_size)
+{
+	return (section_size >= LOGDB_SECTION_ALIGNMENT) && (section_size <= LOGDB_SECTION_SIZE_MAX)
+		&& ((section_size % LOGDB_SECTION_ALIGNMENT) == 0);
 }
 
 logdb_connection* logdb_open (const char* path, logdb_open_flags flags)
+{
+	return logdb_open_with_section_size (path, flags, LOGDB_SECTION_SIZE);
+}
+
+logdb_connection* logdb_open_with_section_size (const char* path, logdb_open_flags flags, logdb_size_t section_size)
 {
 	if (!path) {
 		LOG("logdb_open: path is NULL");
 		return NULL;
 	}
+	if (!logdb_connection_valid_section_size (section_size)) {
+		LOG("logdb_open: section size must be a multiple of %d between %d and %d", LOGDB_SECTION_ALIGNMENT, LOGDB_SECTION_ALIGNMENT, LOGDB_SECTION_SIZE_MAX);
+		return NULL;
+	}
 
 	int oflags = O_RDWR;
 	if ((flags & LOGDB_OPEN_CREATE) == LOGDB_OPEN_CREATE)
@@ -46,41 +147,54 @@ logdb_connection* logdb_open (const char* path, logdb_open_flags flags)
 		return NULL;
 	}
 
-	/* If LOGDB_OPEN_CREATE was specified, write a db header, otherwise we need to verify the db header */
-	if ((flags & LOGDB_OPEN_CREATE) == LOGDB_OPEN_CREATE) {
-		VLOG("logdb_open: writing db header");
+	/* Verify the db header. If there is none and LOGDB_OPEN_CREATE was specified, write a new one.
+	    An existing database keeps the section size it was created with. A database written by another
+	    version of logdb is never overwritten, since its log could not be merged back. */
+	VLOG("logdb_open: verifying db header");
 
-		logdb_header_t header;
-		(void)strncpy (header.magic, LOGDB_MAGIC, sizeof (header.magic));
-		header.version = LOGDB_VERSION;
-
-		if (logdb_io_write (fd, &header, sizeof (header)) != 0) {
-			ELOG("logdb_open: write");
+	logdb_header_t header;
+	ssize_t readresult = logdb_io_pread (fd, &header, sizeof (header), 0);
+	if (readresult > 0) {
+		ELOG("logdb_open: read");
+		close (fd);
+		free (logpath);
+		return NULL;
+	}
+	if ((readresult == 0) && (memcmp (&header.magic, LOGDB_MAGIC, sizeof (LOGDB_MAGIC) - 1) == 0)) {
+		if (header.version != LOGDB_VERSION) {
+			LOG("logdb_open: db was written by version %d of logdb, but this is version %d", header.version, LOGDB_VERSION);
+			close (fd);
+			free (logpath);
+			return NULL;
+		}
+		if (!logdb_connection_valid_section_size (header.section_size)) {
+			LOG("logdb_open: db header has an invalid section size");
 			close (fd);
 			free (logpath);
 			return NULL;
 		}
 	} else {
-		VLOG("logdb_open: verifying db header");
-
-		logdb_header_t header;
-		ssize_t result = logdb_io_read (fd, &header, sizeof (header));
-		if (result > 0) {
-			ELOG("logdb_open: read");
+		if ((flags & LOGDB_OPEN_CREATE) != LOGDB_OPEN_CREATE) {
+			LOG("logdb_open: failed to validate db header");
 			close (fd);
 			free (logpath);
 			return NULL;
 		}
 
-		/* Validate the header */
-		if ((result == -1) || (memcmp (&header.magic, LOGDB_MAGIC, sizeof (LOGDB_MAGIC) - 1) != 0)
-			|| (header.version != LOGDB_VERSION)) {
-			LOG("logdb_open: failed to validate db header");
+		VLOG("logdb_open: writing db header");
+		(void)memset (&header, 0, sizeof (header));
+		(void)strncpy (header.magic, LOGDB_MAGIC, sizeof (header.magic));
+		header.version = LOGDB_VERSION;
+		header.section_size = section_size;
+
+		if (logdb_io_pwrite (fd, &header, sizeof (header), 0) != 0) {
+			ELOG("logdb_open: write");
 			close (fd);
 			free (logpath);
 			return NULL;
 		}
 	}
+	section_size = header.section_size;
 
 	/* If we are the first ones to open this file, we need to create a log.
 	 *  The `flock` prevents races with other processes.
@@ -91,7 +205,7 @@ logdb_connection* logdb_open (const char* path, logdb_open_flags flags)
 retry_create:
 	if (flock (fd, LOCK_EX | LOCK_NB) == 0) {
 retry_create_locked:
-		log = logdb_log_create (logpath, fd);
+		log = logdb_log_create (logpath, fd, section_size);
 		if (!log) {
 			VLOG("logdb_open: failed to create log-- there may be an existing one that needs recovery");
 			/* We can end up here if:
@@ -101,7 +215,14 @@ retry_create_locked:
 			 * Since we have the exclusive lock on the db, we're free to investigate.
 			 *  In the case of (1) above, we can just open the existing log and go from there..
 			 */
-			 log = logdb_log_open (logpath);
+			 log = logdb_log_open (logpath, section_size);
+			 if (log && (logdb_log_recover (log, fd) != 0)) {
+				LOG("logdb_open: failed to validate the database against the existing log");
+				logdb_log_close (log);
+				close (fd);
+				free (logpath);
+				return NULL;
+			 }
 			 if (!log) {
 				/* If we get here, the log is corrupt. This can happen for various reasons,
 				 *  but there's not much we can do about it either way. All we can do is delete
@@ -117,6 +238,17 @@ retry_create_locked:
 				goto retry_create_locked;
 			 }
 		}
+
+		/* Nobody else has the database open, so start over with a clean lock table,
+		    and fill in the free-space index from the log */
+		log->shm = logdb_connection_open_shm (path, true);
+		if (!log->shm || (logdb_log_index_free (log) != 0)) {
+			LOG("logdb_open: failed to create shared memory");
+			logdb_log_close (log);
+			close (fd);
+			free (logpath);
+			return NULL;
+		}
 	} else {
 		VLOG("logdb_open: failed to acquire exclusive db lock to setup log-- another process must've already done it");
 		if (nosync) {
@@ -139,7 +271,7 @@ retry_create_locked:
 
 	/* Open the log if we did not create one earlier */
 	if (!log) {
-		log = logdb_log_open (logpath);
+		log = logdb_log_open (logpath, section_size);
 		if (!log) {
 			/* We could end up here if another process was doing a `logdb_close`
 			    and merging the log back into the db when we were previously trying
@@ -155,6 +287,15 @@ retry_create_locked:
 			free (logpath);
 			return NULL;
 		}
+
+		log->shm = logdb_connection_open_shm (path, false);
+		if (!log->shm) {
+			LOG("logdb_open: failed to open shared memory");
+			logdb_log_close (log);
+			close (fd);
+			free (logpath);
+			return NULL;
+		}
 	}
 	free (logpath);
 
@@ -179,11 +320,67 @@ retry_create_locked:
 		goto logclosefail;
 	}
 
-	result->version = LOGDB_VERSION;
+	err = pthread_mutex_init (&result->reserve_lock, NULL);
+	if (err) {
+		LOG("logdb_open: pthread_mutex_init: %s", strerror (err));
+		pthread_key_delete (result->current_txn_key);
+		pthread_rwlock_destroy (&result->lock);
+		free (result);
+		goto logclosefail;
+	}
+	atomic_init (&result->reserved, 0);
+
+	bool datasync = (flags & (LOGDB_OPEN_SYNC_DATA | LOGDB_OPEN_SYNC_RANGE)) != 0;
+	if (logdb_sync_init (&result->data_sync, fd, datasync) != 0)
+		goto keyfail;
+	if (logdb_sync_init (&result->log_sync, log->fd, datasync) != 0)
+		goto datasyncfail;
+
 	result->flags = flags;
+	result->section_size = section_size;
+	result->direct_fd = -1;
+	if ((flags & LOGDB_OPEN_DIRECT) == LOGDB_OPEN_DIRECT) {
+		result->direct_fd = logdb_connection_open_direct (path);
+		if (result->direct_fd == -1)
+			goto logsyncfail;
+	}
+
+	if ((flags & LOGDB_OPEN_STICKY_LEASES) == LOGDB_OPEN_STICKY_LEASES) {
+		err = pthread_key_create (&result->sticky_lease_key, &logdb_lease_sticky_destruct);
+		if (err) {
+			LOG("logdb_open: pthread_key_create: %s", strerror (err));
+			goto directfail;
+		}
+	}
+
+	if (LOGDB_CONNECTION_HAS_FLUSHER(result) && (logdb_flusher_start (&result->flusher, &result->data_sync, &result->log_sync) != 0))
+		goto stickyfail;
+
+	if (logdb_writer_init (&result->writer, result) != 0) {
+		if (LOGDB_CONNECTION_HAS_FLUSHER(result))
+			logdb_flusher_stop (&result->flusher);
+		goto stickyfail;
+	}
+
+	result->version = LOGDB_VERSION;
 	result->fd = fd;
 	result->log = log;
 	return result;
+stickyfail:
+	if ((flags & LOGDB_OPEN_STICKY_LEASES) == LOGDB_OPEN_STICKY_LEASES)
+		pthread_key_delete (result->sticky_lease_key);
+directfail:
+	if (result->direct_fd != -1)
+		close (result->direct_fd);
+logsyncfail:
+	logdb_sync_destroy (&result->log_sync);
+datasyncfail:
+	logdb_sync_destroy (&result->data_sync);
+keyfail:
+	pthread_mutex_destroy (&result->reserve_lock);
+	pthread_key_delete (result->current_txn_key);
+	pthread_rwlock_destroy (&result->lock);
+	free (result);
 logclosefail:
 	logdb_log_close (log);
 	close (fd);
@@ -192,6 +389,10 @@ logclosefail:
 
 int logdb_close LOGDB_VERIFY_CONNECTION(logdb_connection_t* conn)
 {
+	/* Commit anything that was queued with `logdb_commit_async`. This has to happen
+	    before we take the write lock, since the writer needs a read lock to commit. */
+	logdb_writer_stop (&conn->writer);
+
 	/* Wait for any other threads to finish */
 	int err = pthread_rwlock_wrlock (&conn->lock);
 	if (err) {
@@ -203,6 +404,16 @@ int logdb_close LOGDB_VERIFY_CONNECTION(logdb_connection_t* conn)
 	logdb_txn_rollback_all (conn);
 	pthread_key_delete (conn->current_txn_key);
 
+	/* Give up the sections that threads were holding on to */
+	if ((conn->flags & LOGDB_OPEN_STICKY_LEASES) == LOGDB_OPEN_STICKY_LEASES) {
+		pthread_key_delete (conn->sticky_lease_key);
+		logdb_lease_release_all_sticky (conn);
+	}
+
+	/* Make sure everything committed so far is durable before we touch the log */
+	if (LOGDB_CONNECTION_HAS_FLUSHER(conn))
+		logdb_flusher_stop (&conn->flusher);
+
 	/* If we are the last process using the db, merge the log back into it */
 	bool log_closed = false;
 	if (flock (conn->fd, LOCK_EX | LOCK_NB) == 0) {
@@ -220,11 +431,30 @@ int logdb_close LOGDB_VERIFY_CONNECTION(logdb_connection_t* conn)
 		}
 	}
 	flock (conn->fd, LOCK_UN);
+	if (conn->direct_fd != -1)
+		close (conn->direct_fd);
 	close (conn->fd);
+	logdb_sync_destroy (&conn->data_sync);
+	logdb_sync_destroy (&conn->log_sync);
+	pthread_mutex_destroy (&conn->reserve_lock);
 	pthread_rwlock_unlock (&conn->lock);
 	pthread_rwlock_destroy (&conn->lock);
 	/* Just in case this helps.. */
 	conn->version = 0;
 	free (conn);
 	return 0;
-}}
\ No newline at end of file
+}}
+
+int logdb_set_flush_interval LOGDB_VERIFY_CONNECTION(logdb_connection_t* conn, unsigned int millis, logdb_size_t bytes)
+{
+	if (!LOGDB_CONNECTION_HAS_FLUSHER(conn)) {
+		LOG("logdb_set_flush_interval: failed-- connection was not opened with LOGDB_OPEN_SYNC_PERIODIC");
+		return -1;
+	}
+	if (!millis && !bytes) {
+		LOG("logdb_set_flush_interval: failed-- millis and bytes cannot both be zero");
+		return -1;
+	}
+	logdb_flusher_configure (&conn->flusher, millis, bytes);
+	return 0;
+}}
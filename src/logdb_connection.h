@@ -3,8 +3,13 @@
 
 #include "logdb_internal.h"
 #include "logdb_log.h"
+#include "logdb_sync.h"
+#include "logdb_writer.h"
 
 #include <pthread.h>
+#include <stdatomic.h>
+
+struct logdb_lease_t;
 
 /**
  * The magic cookie appearing at byte 0 of the database file.
@@ -17,6 +22,7 @@
 typedef struct {
 	char magic[sizeof(LOGDB_MAGIC) - 1]; /* LOGDB_MAGIC */
 	unsigned short version;
+	logdb_size_t section_size; /* chosen when the database is created */
 } logdb_header_t;
 
 /**
@@ -34,17 +40,47 @@ typedef struct {
 	pthread_rwlock_t lock; /**< protects threaded access to this `logdb_connection_t` */
 	logdb_open_flags flags; /**< the flags used when opening this connection */
 
+	logdb_size_t section_size; /**< size of the sections of the database file, from its header */
 	int fd; /**< file descriptor of database file */
+	int direct_fd; /**< file descriptor of database file opened for direct I/O, or -1 if not opened with `LOGDB_OPEN_DIRECT` */
 	logdb_log_t* log; /**< struct containing fd and metadata about the log file */
+	logdb_sync_t data_sync; /**< group commit state for syncing the database file */
+	logdb_sync_t log_sync; /**< group commit state for syncing the log file */
+	logdb_flusher_t flusher; /**< background sync thread, if opened with `LOGDB_OPEN_SYNC_PERIODIC` */
+	logdb_writer_t writer; /**< background thread for `logdb_commit_async` */
 	pthread_key_t current_txn_key; /**< tls key for the current transaction for this connection */
 
+	pthread_mutex_t reserve_lock; /**< serializes growing `reserved` */
+	volatile atomic_uint reserved; /**< number of sections this connection has preallocated in the db file */
+
+	/* Only used if opened with `LOGDB_OPEN_STICKY_LEASES` */
+	pthread_key_t sticky_lease_key; /**< tls key for the current thread's sticky write lease */
+
 } logdb_connection_t;
 
 /**
  * Returns the offset in the file database corresponding to the
  *  given section index.
  */
-off_t logdb_connection_offset (logdb_size_t index);
+off_t logdb_connection_offset (const logdb_connection_t* conn, logdb_size_t index);
+
+/**
+ * Ensures that space for at least the given number of sections is allocated in the database
+ *  file, preallocating `LOGDB_PREALLOC_SIZE` more at a time. This is only an optimization,
+ *  so it's fine to ignore failures.
+ * \returns Zero (0) on success.
+ */
+int logdb_connection_reserve (logdb_connection_t* conn, logdb_size_t sections);
+
+/**
+ * Returns true if commits on the given connection should be synced before returning.
+ */
+#define LOGDB_CONNECTION_SYNC_ON_COMMIT(conn) (!((conn)->flags & (LOGDB_OPEN_NOSYNC | LOGDB_OPEN_SYNC_PERIODIC)))
+
+/**
+ * Returns true if the given connection has a background flusher.
+ */
+#define LOGDB_CONNECTION_HAS_FLUSHER(conn) (((conn)->flags & (LOGDB_OPEN_NOSYNC | LOGDB_OPEN_SYNC_PERIODIC)) == LOGDB_OPEN_SYNC_PERIODIC)
 
 /**
  * Verifies the first arg is a valid `logdb_connection_t`, otherwise returns -1
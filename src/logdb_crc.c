@@ -0,0 +1,80 @@
+#include "logdb_crc.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#  define LOGDB_CRC_SSE42 1
+#  include <nmmintrin.h>
+#endif
+
+/* Reversed Castagnoli polynomial */
+#define LOGDB_CRC32C_POLY 0x82F63B78u
+
+static uint32_t logdb_crc_table[256];
+static uint32_t (*logdb_crc_impl) (uint32_t crc, const unsigned char* buf, size_t len);
+static pthread_once_t logdb_crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t logdb_crc32c_table (uint32_t crc, const unsigned char* buf, size_t len)
+{
+	while (len--)
+		crc = logdb_crc_table[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef LOGDB_CRC_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t logdb_crc32c_sse42 (uint32_t crc, const unsigned char* buf, size_t len)
+{
+#  ifdef __x86_64__
+	uint64_t crc64 = crc;
+	while (len >= sizeof (uint64_t)) {
+		uint64_t word;
+		(void)memcpy (&word, buf, sizeof (word));
+		crc64 = _mm_crc32_u64 (crc64, word);
+		buf += sizeof (word);
+		len -= sizeof (word);
+	}
+	crc = (uint32_t)crc64;
+#  endif
+	while (len >= sizeof (uint32_t)) {
+		uint32_t word;
+		(void)memcpy (&word, buf, sizeof (word));
+		crc = _mm_crc32_u32 (crc, word);
+		buf += sizeof (word);
+		len -= sizeof (word);
+	}
+	while (len--)
+		crc = _mm_crc32_u8 (crc, *buf++);
+	return crc;
+}
+#endif
+
+static void logdb_crc_init (void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc & 1)? ((crc >> 1) ^ LOGDB_CRC32C_POLY) : (crc >> 1);
+		logdb_crc_table[i] = crc;
+	}
+
+	logdb_crc_impl = &logdb_crc32c_table;
+#ifdef LOGDB_CRC_SSE42
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("sse4.2"))
+		logdb_crc_impl = &logdb_crc32c_sse42;
+#endif
+}
+
+uint32_t logdb_crc32c (uint32_t crc, const void* buf, size_t len)
+{
+	(void)pthread_once (&logdb_crc_once, &logdb_crc_init);
+	return ~logdb_crc_impl (~crc, (const unsigned char*)buf, len);
+}
+
+uint32_t logdb_crc32c_frame (logdb_size_t index, logdb_size_t offset, logdb_size_t len)
+{
+	logdb_size_t seed[3] = { index, offset, len };
+	return logdb_crc32c (0, seed, sizeof (seed));
+}
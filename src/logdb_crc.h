@@ -0,0 +1,25 @@
+#ifndef LOGDB_CRC_H
+#define LOGDB_CRC_H
+
+#include "logdb_internal.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Computes the CRC32C (Castagnoli) checksum of the given data, continuing from the given checksum.
+ *  Pass zero (0) as `crc` to start a new checksum. Uses the SSE4.2 `crc32` instruction where the
+ *  CPU supports it, and a lookup table otherwise.
+ * \returns The checksum of all of the data passed so far.
+ */
+uint32_t logdb_crc32c (uint32_t crc, const void* buf, size_t len);
+
+/**
+ * Starts the checksum of a frame (see `logdb_data_frame_t`) of the given length at the given offset
+ *  of the given section. Binding the checksum to where the frame was written means a frame left over
+ *  from an earlier use of the file can only validate at the exact place it was written.
+ * \returns The checksum to continue with the frame's records.
+ */
+uint32_t logdb_crc32c_frame (logdb_size_t index, logdb_size_t offset, logdb_size_t len);
+
+#endif /* LOGDB_CRC_H */
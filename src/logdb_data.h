@@ -1,6 +1,8 @@
 #ifndef LOGDB_DATA_H
 #define LOGDB_DATA_H
 
+#include <stdint.h>
+
 /**
  * Internal structure that represents the header
  * of a record in the database.
@@ -10,4 +12,15 @@ typedef struct {
     logdb_size_t valuelen;
 } logdb_data_header_t;
 
+/**
+ * Internal structure that precedes the records written by each commit.
+ *  A section holds one or more frames back to back, while a span holds exactly one.
+ *  The checksum lets recovery tell committed data from data that was torn or never
+ *  made it to disk, so the log entry can be made durable at the same time as the data.
+ */
+typedef struct {
+    logdb_size_t len; /**< number of bytes of records following this frame */
+    uint32_t crc; /**< CRC32C of the frame's position and `len`, followed by the records (see `logdb_crc32c_frame`) */
+} logdb_data_frame_t;
+
 #endif /* LOGDB_DATA_H */
\ No newline at end of file
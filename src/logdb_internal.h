@@ -9,14 +9,40 @@
  * The version of the internal data structures (and thus file format).
  * Bump this when any of the structs in this file change.
  */
-#define LOGDB_VERSION 1
+#define LOGDB_VERSION 6
 
 /**
- * The size of the database file sections that are reserved
- * in the log file.
+ * The default size of the database file sections that are reserved
+ * in the log file. The size is chosen when the database is created
+ * (see `logdb_open_with_section_size`) and stored in its header.
  */
 #define LOGDB_SECTION_SIZE 65536 /* bytes */
 
+/**
+ * The largest section size a database can be created with.
+ */
+#define LOGDB_SECTION_SIZE_MAX (256 * 1024 * 1024) /* bytes */
+
+/**
+ * The alignment of the database file sections. The db header
+ * is padded to this size. This must be a multiple of the block size
+ * for `LOGDB_OPEN_DIRECT`. Section sizes must be a multiple of it,
+ * so it is also the smallest section size.
+ */
+#define LOGDB_SECTION_ALIGNMENT 4096 /* bytes */
+
+/**
+ * Returns the offset in the database file of the section with the given index,
+ *  for a database with the given section size.
+ */
+#define LOGDB_SECTION_OFFSET(section_size, index) (LOGDB_SECTION_ALIGNMENT + ((off_t)(index) * (section_size)))
+
+/**
+ * The number of bytes past the end of the highest leased section that
+ * are preallocated in the database file, rounded up to whole sections.
+ */
+#define LOGDB_PREALLOC_SIZE (4 * 1024 * 1024) /* bytes */
+
 /**
  * The minimum size for a valid database file
  */
@@ -1,10 +1,35 @@
+#ifdef __linux__
+#  define _GNU_SOURCE /* for fallocate */
+#endif
+
 #include "logdb_io.h"
+#include "logdb_internal.h"
 
 #include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && defined(__has_include)
+#  if __has_include(<linux/io_uring.h>)
+#    define LOGDB_IO_URING 1
+#    include <linux/io_uring.h>
+#    include <sys/mman.h>
+#    include <sys/syscall.h>
+#  endif
+#endif
+
+#ifndef IOV_MAX
+#  define IOV_MAX 1024
+#endif
 
 ssize_t logdb_io_read (int fd, void* buf, size_t sz)
 {
-    ssize_t bytes;
+    ssize_t bytes = -1; /* not zero, in case `sz` is */
     char* ix = (char*)buf;
     while ((sz > 0) && ((bytes = read (fd, ix, sz)) > 0)) {
         ix += bytes;
@@ -26,7 +51,7 @@ size_t logdb_io_write (int fd, const void* ptr, size_t sz)
 
 ssize_t logdb_io_pread (int fd, void* buf, size_t sz, off_t offs)
 {
-    ssize_t bytes;
+    ssize_t bytes = -1; /* not zero, in case `sz` is */
     char* ix = (char*)buf;
     while ((sz > 0) && ((bytes = pread (fd, ix, sz, offs)) > 0)) {
         offs += bytes;
@@ -36,6 +61,13 @@ ssize_t logdb_io_pread (int fd, void* buf, size_t sz, off_t offs)
     return (bytes == 0)? -1 : sz;
 }
 
+ssize_t logdb_io_pread_once (int fd, void* buf, size_t sz, off_t offs)
+{
+	ssize_t bytes;
+	while (((bytes = pread (fd, buf, sz, offs)) == -1) && (errno == EINTR));
+	return bytes;
+}
+
 size_t logdb_io_pwrite (int fd, const void* ptr, size_t sz, off_t offs)
 {
     ssize_t bytes;
@@ -46,4 +78,364 @@ size_t logdb_io_pwrite (int fd, const void* ptr, size_t sz, off_t offs)
 		sz -= bytes;
 	}
     return sz;
-}
\ No newline at end of file
+}
+
+/**
+ * Advances the given iovec array past the given number of bytes, which may end in the middle of an iovec.
+ */
+static void logdb_io_advance (struct iovec** iov, int* iovcnt, size_t bytes)
+{
+	while (bytes > 0) {
+		size_t len = (bytes < (*iov)->iov_len)? bytes : (*iov)->iov_len;
+		(*iov)->iov_base = (char*)(*iov)->iov_base + len;
+		(*iov)->iov_len -= len;
+		bytes -= len;
+		if ((*iov)->iov_len == 0) {
+			(*iov)++;
+			(*iovcnt)--;
+		}
+	}
+}
+
+size_t logdb_io_pwritev (int fd, struct iovec* iov, int iovcnt, off_t offs)
+{
+	ssize_t bytes;
+	size_t sz = 0;
+	for (int i = 0; i < iovcnt; i++)
+		sz += iov[i].iov_len;
+
+	while (sz > 0) {
+		/* Skip any iovecs that have been completely written */
+		while (iov->iov_len == 0) {
+			iov++;
+			iovcnt--;
+		}
+		bytes = pwritev (fd, iov, (iovcnt > IOV_MAX)? IOV_MAX : iovcnt, offs);
+		if (bytes <= 0)
+			break;
+		offs += bytes;
+		sz -= bytes;
+		logdb_io_advance (&iov, &iovcnt, bytes);
+	}
+	return sz;
+}
+
+int logdb_io_preallocate (int fd, off_t offs, off_t len)
+{
+#ifdef __linux__
+	/* N.B. We don't fall back to `posix_fallocate`, since where the file system can't do this
+	    it emulates it by writing to the file, which could clobber other processes' writes. */
+	int result;
+	while (((result = fallocate (fd, 0, offs, len)) == -1) && (errno == EINTR));
+	if (result == 0)
+		return 0;
+	return ((errno == EOPNOTSUPP) || (errno == ENOSYS))? -2 : -1;
+#else
+	return -2;
+#endif
+}
+
+/**
+ * Performs the given operation with the blocking calls, after skipping the first `done` bytes of a write.
+ * \returns Zero (0) on success.
+ */
+static int logdb_io_run_op (logdb_io_op_t* op, size_t done)
+{
+	switch (op->type) {
+	case LOGDB_IO_OP_WRITEV:
+		logdb_io_advance (&op->iov, &op->iovcnt, done);
+		return (logdb_io_pwritev (op->fd, op->iov, op->iovcnt, op->offset + done) == 0)? 0 : -1;
+	case LOGDB_IO_OP_FDATASYNC:
+#if defined(_POSIX_SYNCHRONIZED_IO) && (_POSIX_SYNCHRONIZED_IO > 0)
+		return fdatasync (op->fd);
+#else
+		return fsync (op->fd);
+#endif
+	case LOGDB_IO_OP_FSYNC:
+		return fsync (op->fd);
+	}
+	return -1;
+}
+
+#ifdef LOGDB_IO_URING
+
+/**
+ * The number of entries in each thread's ring.
+ */
+#define LOGDB_IO_RING_ENTRIES LOGDB_IO_CHAIN_MAX
+
+/**
+ * Internal struct for an io_uring instance, which is only ever used by the thread that created it.
+ *  Since each chain is reaped before the next one is submitted, the ring is always empty between chains.
+ */
+typedef struct {
+	int fd;
+	unsigned int* sq_tail;
+	unsigned int* sq_mask;
+	unsigned int* sq_array;
+	struct io_uring_sqe* sqes;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int* cq_mask;
+	struct io_uring_cqe* cqes;
+	void* sq_ptr; /**< mapping of the submission ring */
+	size_t sq_size;
+	void* cq_ptr; /**< mapping of the completion ring; may equal `sq_ptr` */
+	size_t cq_size;
+	size_t sqes_size;
+} logdb_io_ring_t;
+
+static pthread_key_t logdb_io_ring_key;
+static pthread_once_t logdb_io_ring_once = PTHREAD_ONCE_INIT;
+static bool logdb_io_ring_key_valid = false;
+static volatile atomic_bool logdb_io_ring_unsupported = false;
+
+static void logdb_io_ring_free (void* arg)
+{
+	logdb_io_ring_t* ring = (logdb_io_ring_t*)arg;
+	if (ring->sqes)
+		munmap (ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr && (ring->cq_ptr != ring->sq_ptr))
+		munmap (ring->cq_ptr, ring->cq_size);
+	if (ring->sq_ptr)
+		munmap (ring->sq_ptr, ring->sq_size);
+	close (ring->fd);
+	free (ring);
+}
+
+static void logdb_io_ring_init_key (void)
+{
+	logdb_io_ring_key_valid = (pthread_key_create (&logdb_io_ring_key, &logdb_io_ring_free) == 0);
+}
+
+static logdb_io_ring_t* logdb_io_ring_new (void)
+{
+	struct io_uring_params params;
+	(void)memset (&params, 0, sizeof (params));
+	int fd = (int)syscall (__NR_io_uring_setup, LOGDB_IO_RING_ENTRIES, &params);
+	if (fd == -1) {
+		/* e.g. ENOSYS on older kernels, or EPERM if it's been disabled. Don't bother trying again. */
+		VLOG("logdb_io_ring_new: io_uring_setup: %s", strerror (errno));
+		atomic_store (&logdb_io_ring_unsupported, true);
+		return NULL;
+	}
+
+	logdb_io_ring_t* ring = calloc (1, sizeof (logdb_io_ring_t));
+	if (!ring) {
+		ELOG("logdb_io_ring_new: calloc");
+		close (fd);
+		return NULL;
+	}
+	ring->fd = fd;
+
+	ring->sq_size = params.sq_off.array + (params.sq_entries * sizeof (unsigned int));
+	ring->cq_size = params.cq_off.cqes + (params.cq_entries * sizeof (struct io_uring_cqe));
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+	ring->sq_ptr = mmap (NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		ring->sq_ptr = NULL;
+		goto mmapfail;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap (NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			ring->cq_ptr = NULL;
+			goto mmapfail;
+		}
+	}
+	ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+	ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto mmapfail;
+	}
+
+	ring->sq_tail = (unsigned int*)((char*)ring->sq_ptr + params.sq_off.tail);
+	ring->sq_mask = (unsigned int*)((char*)ring->sq_ptr + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int*)((char*)ring->sq_ptr + params.sq_off.array);
+	ring->cq_head = (unsigned int*)((char*)ring->cq_ptr + params.cq_off.head);
+	ring->cq_tail = (unsigned int*)((char*)ring->cq_ptr + params.cq_off.tail);
+	ring->cq_mask = (unsigned int*)((char*)ring->cq_ptr + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ptr + params.cq_off.cqes);
+	return ring;
+mmapfail:
+	ELOG("logdb_io_ring_new: mmap");
+	logdb_io_ring_free (ring);
+	return NULL;
+}
+
+/**
+ * Returns the calling thread's ring, creating it if needed, or NULL if io_uring is unavailable.
+ */
+static logdb_io_ring_t* logdb_io_ring_current (void)
+{
+	if (atomic_load (&logdb_io_ring_unsupported))
+		return NULL;
+	if ((pthread_once (&logdb_io_ring_once, &logdb_io_ring_init_key) != 0) || !logdb_io_ring_key_valid)
+		return NULL;
+
+	logdb_io_ring_t* ring = (logdb_io_ring_t*)pthread_getspecific (logdb_io_ring_key);
+	if (!ring) {
+		ring = logdb_io_ring_new ();
+		if (ring && (pthread_setspecific (logdb_io_ring_key, ring) != 0)) {
+			logdb_io_ring_free (ring);
+			ring = NULL;
+		}
+	}
+	return ring;
+}
+
+/**
+ * Gives up on the calling thread's ring, e.g. if it ended up in a state we can't recover from.
+ */
+static void logdb_io_ring_discard (logdb_io_ring_t* ring)
+{
+	(void)pthread_setspecific (logdb_io_ring_key, NULL);
+	logdb_io_ring_free (ring);
+}
+
+/**
+ * Submits the given chains, each as linked requests, and waits for all of them to complete.
+ * \param results Set to the result of each operation, as for the corresponding system call, but with
+ *  negated `errno`s. Operations that were never submitted, or never completed, are set to `-ECANCELED`.
+ */
+static void logdb_io_ring_run (logdb_io_ring_t* ring, logdb_io_op_t* ops, const int* lens, int nchains, int* results)
+{
+	unsigned int tail = *(ring->sq_tail);
+	unsigned int mask = *(ring->sq_mask);
+	int count = 0;
+	for (int chain = 0; chain < nchains; chain++)
+		count += lens[chain];
+	for (int i = 0, chain = 0, end = lens[0]; i < count; i++) {
+		if (i == end)
+			end += lens[++chain];
+		unsigned int index = (tail + i) & mask;
+		struct io_uring_sqe* sqe = &ring->sqes[index];
+		(void)memset (sqe, 0, sizeof (*sqe));
+		sqe->fd = ops[i].fd;
+		sqe->user_data = i;
+		if (i < (end - 1))
+			sqe->flags = IOSQE_IO_LINK;
+		switch (ops[i].type) {
+		case LOGDB_IO_OP_WRITEV:
+			sqe->opcode = IORING_OP_WRITEV;
+			sqe->addr = (unsigned long)ops[i].iov;
+			sqe->len = ops[i].iovcnt;
+			sqe->off = ops[i].offset;
+			break;
+		case LOGDB_IO_OP_FDATASYNC:
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+			/* fall through */
+		case LOGDB_IO_OP_FSYNC:
+			sqe->opcode = IORING_OP_FSYNC;
+			break;
+		}
+		ring->sq_array[index] = index;
+		results[i] = -ECANCELED;
+	}
+	atomic_store_explicit ((_Atomic unsigned int*)ring->sq_tail, tail + count, memory_order_release);
+
+	int submitted;
+	while (((submitted = (int)syscall (__NR_io_uring_enter, ring->fd, count, count, IORING_ENTER_GETEVENTS, NULL, 0)) == -1) && (errno == EINTR));
+	if (submitted != count) {
+		/* We can't take back what's left in the submission queue, so reap what we can and discard the ring */
+		VLOG("logdb_io_ring_run: io_uring_enter submitted %d of %d", submitted, count);
+		if (submitted < 0)
+			submitted = 0;
+	}
+
+	for (int reaped = 0; reaped < submitted; ) {
+		unsigned int head = *(ring->cq_head);
+		unsigned int avail = atomic_load_explicit ((_Atomic unsigned int*)ring->cq_tail, memory_order_acquire);
+		if (head == avail) {
+			if ((syscall (__NR_io_uring_enter, ring->fd, 0, submitted - reaped, IORING_ENTER_GETEVENTS, NULL, 0) == -1) && (errno != EINTR)) {
+				ELOG("logdb_io_ring_run: io_uring_enter");
+				logdb_io_ring_discard (ring);
+				return;
+			}
+			continue;
+		}
+		for (; head != avail; head++, reaped++) {
+			struct io_uring_cqe* cqe = &ring->cqes[head & *(ring->cq_mask)];
+			if (cqe->user_data < (unsigned long long)count)
+				results[cqe->user_data] = cqe->res;
+		}
+		atomic_store_explicit ((_Atomic unsigned int*)ring->cq_head, head, memory_order_release);
+	}
+
+	if (submitted != count)
+		logdb_io_ring_discard (ring);
+}
+
+#endif /* LOGDB_IO_URING */
+
+int logdb_io_chain_supported (void)
+{
+#ifdef LOGDB_IO_URING
+	return logdb_io_ring_current () != NULL;
+#else
+	return 0;
+#endif
+}
+
+int logdb_io_run_chains (logdb_io_op_t* ops, const int* lens, int nchains, int* done)
+{
+	int count = 0;
+	for (int chain = 0; chain < nchains; chain++)
+		count += lens[chain];
+
+#ifdef LOGDB_IO_URING
+	int results[LOGDB_IO_CHAIN_MAX];
+	logdb_io_ring_t* ring = (count <= LOGDB_IO_CHAIN_MAX)? logdb_io_ring_current () : NULL;
+	if (ring)
+		logdb_io_ring_run (ring, ops, lens, nchains, results);
+#endif
+
+	int result = 0;
+	for (int chain = 0, base = 0; chain < nchains; base += lens[chain++]) {
+		logdb_io_op_t* chainops = ops + base;
+		int i = 0;
+		size_t partial = 0;
+#ifdef LOGDB_IO_URING
+		for (; ring && (i < lens[chain]); i++) {
+			int res = results[base + i];
+			if (chainops[i].type != LOGDB_IO_OP_WRITEV) {
+				/* Syncs that failed (rather than being canceled) must not be retried */
+				if (res == 0)
+					continue;
+				if (res != -ECANCELED)
+					goto chainfail;
+				break;
+			}
+
+			size_t len = 0;
+			for (int j = 0; j < chainops[i].iovcnt; j++)
+				len += chainops[i].iov[j].iov_len;
+			if ((res < 0) || ((size_t)res < len)) {
+				/* Finish this write ourselves, from wherever the ring left off */
+				partial = (res > 0)? res : 0;
+				break;
+			}
+		}
+#endif
+		for (; i < lens[chain]; i++) {
+			if (logdb_io_run_op (&chainops[i], partial) != 0) {
+				ELOG("logdb_io_run_chains");
+				goto chainfail;
+			}
+			partial = 0;
+		}
+		done[chain] = i;
+		continue;
+chainfail:
+		done[chain] = i;
+		result = -1;
+	}
+	return result;
+}
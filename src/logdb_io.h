@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 /**
  * Reads from the given fd at the current file pointer into the given buffer.
@@ -22,10 +23,78 @@ size_t logdb_io_write (int fd, const void* ptr, size_t sz);
  */
 ssize_t logdb_io_pread (int fd, void* buf, size_t sz, off_t offs);
 
+/**
+ * Reads from the given fd at the given position with a single `pread`, retrying only if interrupted.
+ *  Unlike `logdb_io_pread`, short reads are not resumed, so this is suitable for fds opened with `O_DIRECT`.
+ * \returns The number of bytes read, which is less than `sz` at end of file. On failure, -1.
+ */
+ssize_t logdb_io_pread_once (int fd, void* buf, size_t sz, off_t offs);
+
 /**
  * Writes the given data to the given fd at the given position.
  * \returns Zero (0) on success. On failure, the amount of data remaining to be written.
  */
 size_t logdb_io_pwrite (int fd, const void* ptr, size_t sz, off_t offs);
 
+/**
+ * Writes the data described by the given iovecs to the given fd at the given position.
+ *  Partial writes are resumed, and arrays longer than `IOV_MAX` are written in batches.
+ *  Note that the passed `iov` array is modified to track progress.
+ * \returns Zero (0) on success. On failure, the amount of data remaining to be written.
+ */
+size_t logdb_io_pwritev (int fd, struct iovec* iov, int iovcnt, off_t offs);
+
+/**
+ * Kinds of operations that can be chained with `logdb_io_run_chains`.
+ */
+typedef enum {
+	LOGDB_IO_OP_WRITEV, /**< write `iov` to `fd` at `offset` */
+	LOGDB_IO_OP_FSYNC, /**< `fsync` the `fd` */
+	LOGDB_IO_OP_FDATASYNC /**< `fdatasync` the `fd`, or `fsync` where that is not available */
+} logdb_io_op_type;
+
+/**
+ * Internal struct that describes one operation in a chain passed to `logdb_io_run_chains`.
+ */
+typedef struct {
+	logdb_io_op_type type;
+	int fd;
+	struct iovec* iov; /**< for writes, the data to write. Modified to track progress */
+	int iovcnt;
+	off_t offset;
+} logdb_io_op_t;
+
+/**
+ * The maximum number of operations in all of the chains passed to `logdb_io_run_chains`.
+ */
+#define LOGDB_IO_CHAIN_MAX 8
+
+/**
+ * Performs the given chains of operations. The operations of each chain are performed in order, stopping
+ *  at the first one that fails, but the chains are independent of each other. Where io_uring is available,
+ *  all of the chains are submitted to the kernel with a single system call, as linked requests on a ring
+ *  owned by the calling thread, so the chains run at the same time. Otherwise, or for any operations the
+ *  ring doesn't complete (e.g. short writes), this falls back to the blocking calls, one chain after the
+ *  other. A failed sync is never retried, since the kernel may have dropped the dirty data it failed to write.
+ * \param ops The operations of all of the chains, one chain after the other.
+ * \param lens The number of operations in each chain.
+ * \param nchains The number of chains.
+ * \param done Set to the number of operations of each chain that completed successfully.
+ * \returns Zero (0) if all of the operations completed successfully.
+ */
+int logdb_io_run_chains (logdb_io_op_t* ops, const int* lens, int nchains, int* done);
+
+/**
+ * Checks whether `logdb_io_run_chains` can use io_uring on the calling thread.
+ * \returns Nonzero if it can.
+ */
+int logdb_io_chain_supported (void);
+
+/**
+ * Allocates disk space for the given range of the given fd, extending the file if needed.
+ *  Data already in the range is left untouched.
+ * \returns Zero (0) on success. If the platform or file system does not support it, -2. Otherwise, -1.
+ */
+int logdb_io_preallocate (int fd, off_t offs, off_t len);
+
 #endif /* LOGBD_IO_H */
\ No newline at end of file
@@ -1,20 +1,269 @@
 
 #include "logdb_iter.h"
+#include "logdb_io.h"
 
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * A read-only mapping of the database file, owned by a buffer (see `logdb_iter_t.map`).
+ */
+typedef struct {
+	void* addr;
+	size_t len;
+} logdb_iter_map_t;
+
+static void logdb_iter_unmap (void* data)
+{
+	logdb_iter_map_t* map = (logdb_iter_map_t*)data;
+	munmap (map->addr, map->len);
+	free (map);
+}
+
+/**
+ * Replaces the iterator's mapping of the db file with one that covers at least `end` bytes.
+ *  Like the log, the file is mapped past its end so that we don't have to remap every time a
+ *  writer appends a section. Keys and values handed out from the old mapping keep it alive.
+ * \returns Zero (0) on success.
+ */
+static int logdb_iter_remap (logdb_iter_t* iter, off_t end)
+{
+	struct stat st;
+	if (fstat (iter->connection->fd, &st) == -1) {
+		ELOG("logdb_iter_remap: fstat");
+		return -1;
+	}
+	if (st.st_size < end) {
+		LOG("logdb_iter_remap: failed-- committed data past the end of the db file");
+		return -1;
+	}
+
+	logdb_iter_map_t* map = malloc (sizeof (logdb_iter_map_t));
+	if (!map) {
+		ELOG("logdb_iter_remap: malloc");
+		return -1;
+	}
+	map->len = (size_t)st.st_size * 2;
+	map->addr = mmap (NULL, map->len, PROT_READ, MAP_SHARED, iter->connection->fd, 0);
+	if (map->addr == MAP_FAILED) {
+		ELOG("logdb_iter_remap: mmap");
+		free (map);
+		return -1;
+	}
+	/* We read the file front to back, so let the kernel read ahead aggressively */
+	(void)madvise (map->addr, map->len, MADV_SEQUENTIAL);
+
+	logdb_buffer_t* buf = (logdb_buffer_t*)logdb_buffer_new_direct (map, sizeof (logdb_iter_map_t), &logdb_iter_unmap);
+	if (!buf) {
+		logdb_iter_unmap (map);
+		return -1;
+	}
+
+	logdb_buffer_free (iter->map);
+	iter->map = buf;
+	iter->map_addr = (const char*)map->addr;
+	iter->map_len = map->len;
+	return 0;
+}
+
+/**
+ * Returns a pointer to the next `len` bytes of the iterator's current lease in its mapping
+ *  of the db file, remapping it if needed. Does not advance the lease.
+ * \returns The pointer, or NULL on failure.
+ */
+static const char* logdb_iter_mapped_data (logdb_iter_t* iter, logdb_size_t len)
+{
+	if (len > iter->lease.len) {
+		LOG("logdb_iter_mapped_data: failed-- len exceeds lease size");
+		return NULL;
+	}
+
+	off_t offset = logdb_connection_offset (iter->connection, iter->lease.index) + iter->lease.offset;
+	if (((size_t)(offset + len) > iter->map_len) && (logdb_iter_remap (iter, offset + len) != 0))
+		return NULL;
+	return iter->map_addr + offset;
+}
+
+/**
+ * Replaces the iterator's block with a newly allocated one. Direct I/O needs it to be aligned.
+ * \returns Zero (0) on success.
+ */
+static int logdb_iter_new_block (logdb_iter_t* iter)
+{
+	void* data;
+	int err = posix_memalign (&data, LOGDB_SECTION_ALIGNMENT, iter->connection->section_size);
+	if (err) {
+		LOG("logdb_iter_new_block: posix_memalign: %s", strerror (err));
+		return -1;
+	}
+
+	logdb_buffer_t* block = (logdb_buffer_t*)logdb_buffer_new_direct (data, iter->connection->section_size, &free);
+	if (!block) {
+		free (data);
+		return -1;
+	}
+
+	logdb_buffer_free (iter->block);
+	iter->block = block;
+	iter->window_len = 0;
+	return 0;
+}
+
+static bool logdb_iter_in_window (const logdb_iter_t* iter, off_t offset)
+{
+	return (offset >= iter->window_offset) && (offset < (iter->window_offset + (off_t)iter->window_len));
+}
+
+/**
+ * Reads up to a section's worth of the current lease, starting at the given offset in the db file,
+ *  into the iterator's block with a single system call. We don't read past the end of the lease, since
+ *  anything after it may be being written, except with direct I/O, where reads must be whole aligned
+ *  blocks. Keys and values from the last block may still point into it, in which case we read into a new one.
+ * \returns Zero (0) on success.
+ */
+static int logdb_iter_fill (logdb_iter_t* iter, off_t offset)
+{
+	if ((atomic_load (&iter->block->refcnt) > 1) && (logdb_iter_new_block (iter) != 0))
+		return -1;
+
+	logdb_connection_t* conn = iter->connection;
+	off_t start = offset;
+	ssize_t bytes;
+	if (iter->reverse) {
+		/* We'll want the records before this one next, so read up to half a section of them too.
+		    This is a whole number of aligned blocks, so that the offset stays in the window with direct I/O. */
+		off_t begin = logdb_connection_offset (conn, iter->lease.index);
+		off_t back = (conn->section_size / 2) - ((conn->section_size / 2) % LOGDB_SECTION_ALIGNMENT);
+		start = ((offset - begin) > back)? (offset - back) : begin;
+	}
+	if (conn->direct_fd != -1) {
+		start -= start % LOGDB_SECTION_ALIGNMENT;
+		bytes = logdb_io_pread_once (conn->direct_fd, iter->block->data, conn->section_size, start);
+	} else {
+		off_t end = logdb_connection_offset (conn, iter->lease.index) + iter->lease.offset + iter->lease.len;
+		bytes = ((end - start) < (off_t)conn->section_size)? (end - start) : (off_t)conn->section_size;
+		if (logdb_io_pread (conn->fd, iter->block->data, bytes, start) != 0)
+			bytes = -1;
+	}
+	if (bytes <= (offset - start)) {
+		ELOG("logdb_iter_fill: pread");
+		iter->window_len = 0;
+		return -1;
+	}
+	iter->window_offset = start;
+	iter->window_len = bytes;
+	return 0;
+}
+
+/**
+ * Reads from the iterator's current lease, by way of its mapping of the db file
+ *  or the block of the file it last read.
+ * \returns Zero (0) on success.
+ */
+static int logdb_iter_read (logdb_iter_t* iter, void* buf, logdb_size_t len)
+{
+	if (iter->map) {
+		const char* data = logdb_iter_mapped_data (iter, len);
+		if (!data)
+			return -1;
+		(void)memcpy (buf, data, len);
+		return (logdb_lease_seek (&iter->lease, len) == -1)? -1 : 0;
+	}
+
+	if (len > iter->lease.len) {
+		LOG("logdb_iter_read: failed-- len exceeds lease size");
+		return -1;
+	}
+
+	off_t offset = logdb_connection_offset (iter->connection, iter->lease.index) + iter->lease.offset;
+	char* ix = (char*)buf;
+	logdb_size_t remaining = len;
+	while (remaining) {
+		if (!logdb_iter_in_window (iter, offset) && (logdb_iter_fill (iter, offset) != 0))
+			return -1;
+
+		size_t available = (iter->window_offset + iter->window_len) - offset;
+		size_t bytes = (remaining < available)? remaining : available;
+		(void)memcpy (ix, (char*)iter->block->data + (offset - iter->window_offset), bytes);
+		ix += bytes;
+		offset += bytes;
+		remaining -= bytes;
+	}
+	return (logdb_lease_seek (&iter->lease, len) == -1)? -1 : 0;
+}
+
+/**
+ * Reads the next `len` bytes of the iterator's current lease into a new buffer. If they are in the
+ *  iterator's mapping or block, the buffer points straight into it, and keeps it alive for as long
+ *  as the buffer is retained.
+ * \returns The buffer, or NULL on failure.
+ */
 static logdb_buffer_t* logdb_iter_read_buf (logdb_iter_t* iter, logdb_size_t len)
 {
+	logdb_buffer_t* owner = iter->map;
+	char* data = NULL;
+	if (owner) {
+		data = (char*)logdb_iter_mapped_data (iter, len);
+		if (!data)
+			return NULL;
+	} else if (len <= iter->lease.len) {
+		off_t offset = logdb_connection_offset (iter->connection, iter->lease.index) + iter->lease.offset;
+		if (len && !logdb_iter_in_window (iter, offset) && (logdb_iter_fill (iter, offset) != 0))
+			return NULL;
+		owner = iter->block;
+		if (!len)
+			data = (char*)owner->data;
+		else if ((offset + len) <= (iter->window_offset + (off_t)iter->window_len))
+			data = (char*)owner->data + (offset - iter->window_offset);
+	}
+
+	if (data) {
+		logdb_buffer_t* result = logdb_buffer_new_slice (owner, data, len);
+		if (result && (logdb_lease_seek (&iter->lease, len) == -1)) {
+			logdb_buffer_free (result);
+			return NULL;
+		}
+		return result;
+	}
+
+	/* It doesn't fit in a block, which only happens in spans, so copy it out */
 	void* buf = malloc (len);
 	if (!buf) {
 		ELOG("logdb_iter_read_buf: malloc");
 		return NULL;
 	}
 
-	if (logdb_lease_read (&iter->lease, buf, len) != 0)
+	if (logdb_iter_read (iter, buf, len) != 0) {
+		free (buf);
 		return NULL;
+	}
 
 	return logdb_buffer_new_direct (buf, len, &free);
 }
 
+/**
+ * Creates an iterator that reads the sections whose log entries are in the given range.
+ * \returns The new iterator, or NULL on failure.
+ */
+static logdb_iter_t* logdb_iter_new (logdb_connection_t* conn, logdb_size_t start, logdb_size_t end)
+{
+	logdb_iter_t* iter = calloc (1, sizeof (logdb_iter_t));
+	if (!iter) {
+		ELOG("logdb_iter_new: calloc");
+		return NULL;
+	}
+
+	iter->connection = conn;
+	iter->start = start;
+	iter->end = end;
+	if (logdb_iter_new_block (iter) != 0) {
+		free (iter);
+		return NULL;
+	}
+	return iter;
+}
+
 logdb_iter* logdb_iter_all (logdb_connection* connection)
 {
 	logdb_connection_t* conn = (logdb_connection_t*)connection;
@@ -22,40 +271,242 @@ logdb_iter* logdb_iter_all (logdb_connection* connection)
 		LOG("logdb_iter_all: failed-- passed connection was either null, already closed, or incorrect version");
 		return NULL;
 	}
+	return logdb_iter_new (conn, 0, LOGDB_ITER_NO_END);
+}
+
+int logdb_iter_partition (logdb_connection* connection, int count, logdb_iter** iters)
+{
+	logdb_connection_t* conn = (logdb_connection_t*)connection;
+	DBGIF(!conn || (conn->version != LOGDB_VERSION)) {
+		LOG("logdb_iter_partition: failed-- passed connection was either null, already closed, or incorrect version");
+		return -1;
+	}
+	DBGIF((count < 1) || !iters) {
+		LOG("logdb_iter_partition: failed-- count must be positive and iters not NULL");
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat (conn->log->fd, &st) == -1) {
+		ELOG("logdb_iter_partition: fstat");
+		return -1;
+	}
+
+	/* Split the sections we have now evenly by number. A span that crosses into the next range
+	    is read by the iterator whose range it starts in, and skipped by the next one like any
+	    other continuation. Sections added from here on go to the last iterator. */
+	unsigned long long sections = logdb_log_index_from_offset (conn->log, st.st_size);
+	for (int i = 0; i < count; i++) {
+		logdb_size_t start = (logdb_size_t)((sections * i) / count);
+		logdb_size_t end = (i == (count - 1))? LOGDB_ITER_NO_END : (logdb_size_t)((sections * (i + 1)) / count);
+		iters[i] = logdb_iter_new (conn, start, end);
+		if (!iters[i]) {
+			while (i--)
+				logdb_iter_free (iters[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+logdb_iter* logdb_iter_reverse (logdb_connection* connection)
+{
+	logdb_connection_t* conn = (logdb_connection_t*)connection;
+	DBGIF(!conn || (conn->version != LOGDB_VERSION)) {
+		LOG("logdb_iter_reverse: failed-- passed connection was either null, already closed, or incorrect version");
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat (conn->log->fd, &st) == -1) {
+		ELOG("logdb_iter_reverse: fstat");
+		return NULL;
+	}
+
+	logdb_iter_t* iter = logdb_iter_new (conn, 0, logdb_log_index_from_offset (conn->log, st.st_size));
+	if (iter)
+		iter->reverse = true;
+	return iter;
+}
+
+logdb_iter* logdb_iter_follow (logdb_connection* connection)
+{
+	logdb_connection_t* conn = (logdb_connection_t*)connection;
+	DBGIF(!conn || (conn->version != LOGDB_VERSION)) {
+		LOG("logdb_iter_follow: failed-- passed connection was either null, already closed, or incorrect version");
+		return NULL;
+	}
+
+	logdb_iter_t* iter = logdb_iter_new (conn, 0, LOGDB_ITER_NO_END);
+	if (iter)
+		iter->follow = true;
+	return iter;
+}
+
+logdb_iter* logdb_iter_snapshot (logdb_connection* connection)
+{
+	logdb_connection_t* conn = (logdb_connection_t*)connection;
+	DBGIF(!conn || (conn->version != LOGDB_VERSION)) {
+		LOG("logdb_iter_snapshot: failed-- passed connection was either null, already closed, or incorrect version");
+		return NULL;
+	}
+
+	logdb_iter_t* iter = logdb_iter_new (conn, 0, LOGDB_ITER_NO_END);
+	if (iter && (logdb_log_snapshot (conn->log, &iter->snapshot) != 0)) {
+		logdb_iter_free (iter);
+		return NULL;
+	}
+	return iter;
+}
+
+logdb_iter* logdb_iter_mapped (logdb_connection* connection)
+{
+	logdb_connection_t* conn = (logdb_connection_t*)connection;
+	DBGIF(!conn || (conn->version != LOGDB_VERSION)) {
+		LOG("logdb_iter_mapped: failed-- passed connection was either null, already closed, or incorrect version");
+		return NULL;
+	}
 
 	logdb_iter_t* iter = calloc (1, sizeof (logdb_iter_t));
 	if (!iter) {
-		ELOG("logdb_iter_all: calloc");
+		ELOG("logdb_iter_mapped: calloc");
 		return NULL;
 	}
 
 	iter->connection = conn;
+	iter->end = LOGDB_ITER_NO_END;
+	if (logdb_iter_remap (iter, 0) != 0) {
+		free (iter);
+		return NULL;
+	}
 	return iter;
 }
 
-int logdb_iter_next LOGDB_VERIFY_ITER(logdb_iter_t* iter)
+/**
+ * Takes a lease on the last span before the reverse iterator's `end` that has any data,
+ *  and moves `end` down to its first section.
+ * \returns Zero (0) on success, or -1 if there is none or on failure.
+ */
+static int logdb_iter_lease_prev (logdb_iter_t* iter)
 {
-	if (iter->lease.len < sizeof (logdb_data_header_t)) {
-		/* No more data left on our current lease-- find the next one */
-		logdb_size_t index = 0;
-		if (iter->lease.connection) {
-			index = iter->lease.index + 1;
-			logdb_lease_release (&iter->lease);
-		}
-		logdb_log_entry_t entry;
-		while (1) {
-			if (logdb_log_read_entry (iter->connection->log, &entry, index) == -1)
-				return 0;
-			if (entry.len)
+	logdb_log_t* log = iter->connection->log;
+	while (iter->end > iter->start) {
+		/* If we're at the end of a span, walk back to its first section */
+		logdb_size_t index = iter->end - 1;
+		while (index > iter->start) {
+			logdb_log_entry_t entry;
+			if (logdb_log_read_entry (log, &entry, index) == -1)
+				return -1;
+			if (!(entry.len & LOGDB_LOG_ENTRY_CONTINUATION))
 				break;
-			else
-				index++;
+			index--;
 		}
-		
-		/* Take a lease to read the record header for the next index */
-		if (logdb_lease_acqire_read (&iter->lease, iter->connection, index, 0) != 0)
+		iter->end = index;
+
+		logdb_size_t count;
+		off_t len = logdb_log_read_span (log, index, &count);
+		if (len == -1)
+			return -1;
+		if (len)
+			return logdb_lease_acqire_read (&iter->lease, iter->connection, index, 0);
+	}
+	return -1;
+}
+
+/**
+ * Reads through the reverse iterator's current lease, recording where each record starts.
+ *  Records only say how long they are, so this is the only way to find the one before a given record.
+ * \returns Zero (0) on success.
+ */
+static int logdb_iter_index_records (logdb_iter_t* iter)
+{
+	iter->records_len = 0;
+	while (iter->lease.len >= sizeof (logdb_data_frame_t)) {
+		logdb_data_frame_t frame;
+		if (logdb_iter_read (iter, &frame, sizeof (logdb_data_frame_t)) != 0)
+			return -1;
+
+		logdb_size_t frame_len = frame.len;
+		while (frame_len >= sizeof (logdb_data_header_t)) {
+			if (iter->records_len == iter->records_size) {
+				size_t size = iter->records_size? (iter->records_size * 2) : 64;
+				off_t* records = realloc (iter->records, size * sizeof (off_t));
+				if (!records) {
+					ELOG("logdb_iter_index_records: realloc");
+					return -1;
+				}
+				iter->records = records;
+				iter->records_size = size;
+			}
+			iter->records[iter->records_len] = iter->lease.offset;
+
+			logdb_data_header_t record;
+			if (logdb_iter_read (iter, &record, sizeof (logdb_data_header_t)) != 0)
+				return -1;
+			logdb_size_t reclen = sizeof (logdb_data_header_t) + record.keylen + record.valuelen;
+			if ((reclen < record.keylen) || (reclen > frame_len)) {
+				LOG("logdb_iter_index_records: record overruns its frame in section %d", iter->lease.index);
+				return -1;
+			}
+			if (logdb_lease_seek (&iter->lease, reclen - sizeof (logdb_data_header_t)) == -1)
+				return -1;
+			iter->records_len++;
+			frame_len -= reclen;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Advances a reverse iterator to the record before the current one, going back a section when
+ *  we've returned all the records in this one.
+ * \returns One (1) on success, or zero (0) if there are no more records or on failure.
+ */
+static int logdb_iter_prev (logdb_iter_t* iter)
+{
+	while (!(iter->records_len)) {
+		if (iter->lease.connection)
+			logdb_lease_release (&iter->lease);
+		iter->window_len = 0;
+		if (logdb_iter_lease_prev (iter) != 0)
 			return 0;
-	} else {
+		if (logdb_iter_index_records (iter) != 0)
+			return 0;
+	}
+
+	off_t offset = iter->records[--(iter->records_len)];
+	if ((logdb_lease_seek (&iter->lease, offset - iter->lease.offset) == -1) ||
+	    (logdb_iter_read (iter, &iter->record, sizeof (logdb_data_header_t)) != 0))
+		return 0;
+	return 1;
+}
+
+/**
+ * Returns the slot in a follow iterator's `seen` array for the section at the given index,
+ *  growing the array if needed.
+ * \returns The slot, or NULL on failure.
+ */
+static logdb_size_t* logdb_iter_seen (logdb_iter_t* iter, logdb_size_t index)
+{
+	if (index >= iter->seen_len) {
+		size_t len = iter->seen_len? iter->seen_len : 64;
+		while (len <= index)
+			len *= 2;
+		logdb_size_t* seen = realloc (iter->seen, len * sizeof (logdb_size_t));
+		if (!seen) {
+			ELOG("logdb_iter_seen: realloc");
+			return NULL;
+		}
+		(void)memset (seen + iter->seen_len, 0, (len - iter->seen_len) * sizeof (logdb_size_t));
+		iter->seen = seen;
+		iter->seen_len = len;
+	}
+	return &iter->seen[index];
+}
+
+int logdb_iter_next LOGDB_VERIFY_ITER(logdb_iter_t* iter)
+{
+	if (iter->lease.connection && !(iter->reverse)) {
 		/* Skip past the key and/or value if they weren't read */
 		if (!(iter->key) && (logdb_lease_seek (&iter->lease, iter->record.keylen) == -1))
 			return 0;
@@ -73,10 +524,78 @@ int logdb_iter_next LOGDB_VERIFY_ITER(logdb_iter_t* iter)
 		iter->value = NULL;
 	}
 
+	if (iter->reverse)
+		return logdb_iter_prev (iter);
+
+	while (iter->frame_len < sizeof (logdb_data_header_t)) {
+		if (iter->lease.len < sizeof (logdb_data_frame_t)) {
+			/* No more data left on our current lease-- find the next one */
+			logdb_size_t index = iter->start;
+			if (iter->lease.connection) {
+				index = iter->lease.index + iter->lease.count;
+				logdb_lease_release (&iter->lease);
+			}
+			bool from_start = (index == 0);
+			if (iter->follow && from_start)
+				iter->commits = logdb_shm_commits (iter->connection->log->shm);
+			logdb_size_t* seen = NULL;
+			logdb_size_t count;
+			off_t offset = 0;
+			off_t len;
+			while (1) {
+				if (index >= iter->end)
+					return 0;
+				len = iter->snapshot.entries?
+					logdb_log_snapshot_span (&iter->snapshot, index, &count) :
+					logdb_log_read_span (iter->connection->log, index, &count);
+				if (len == -1) {
+					if (!(iter->follow) || from_start)
+						return 0;
+
+					/* Go around again for anything committed to sections we've already read */
+					index = 0;
+					from_start = true;
+					iter->commits = logdb_shm_commits (iter->connection->log->shm);
+					continue;
+				}
+				if (iter->follow && !(seen = logdb_iter_seen (iter, index)))
+					return 0;
+				offset = seen? *seen : 0;
+				if (len > offset)
+					break;
+				else
+					index += count;
+			}
+
+			/* Take a lease to read the next index. Anything in our window
+			    past the end of the previous lease may have been written since we read it. */
+			iter->window_len = 0;
+			int leased = iter->snapshot.entries?
+				logdb_lease_acquire_read_span (&iter->lease, iter->connection, index, count, len) :
+				logdb_lease_acqire_read (&iter->lease, iter->connection, index, offset);
+			if (leased != 0)
+				return 0;
+			if (seen)
+				*seen = iter->lease.offset + iter->lease.len;
+		}
+
+		/* Each commit's records are preceded by a frame; we only need its length here */
+		logdb_data_frame_t frame;
+		if (logdb_iter_read (iter, &frame, sizeof (logdb_data_frame_t)) != 0)
+			return 0;
+		iter->frame_len = frame.len;
+	}
+
 	/* Read the next record in our lease */
-	if (logdb_lease_read (&iter->lease, &iter->record, sizeof (logdb_data_header_t)) != 0)
+	if (logdb_iter_read (iter, &iter->record, sizeof (logdb_data_header_t)) != 0)
 		return 0;
 
+	logdb_size_t reclen = sizeof (logdb_data_header_t) + iter->record.keylen + iter->record.valuelen;
+	if ((reclen < iter->record.keylen) || (reclen > iter->frame_len)) {
+		LOG("logdb_iter_next: record overruns its frame in section %d", iter->lease.index);
+		return 0;
+	}
+	iter->frame_len -= reclen;
 	return 1;
 }}
 
@@ -110,6 +629,17 @@ logdb_buffer* logdb_iter_current_value LOGDB_VERIFY_ITER(logdb_iter_t* iter)
 	return iter->value;
 }}
 
+int logdb_iter_wait LOGDB_VERIFY_ITER(logdb_iter_t* iter, int millis)
+{
+	DBGIF(!(iter->follow)) {
+		LOG("logdb_iter_wait: failed-- the iterator was not created with `logdb_iter_follow`");
+		return -1;
+	}
+
+	int result = logdb_shm_wait (iter->connection->log->shm, iter->commits, millis);
+	return (result == 0)? 1 : (result == -2)? 0 : -1;
+}}
+
 void logdb_iter_free (logdb_iter* iterator)
 {
 	logdb_iter_t* iter = (logdb_iter_t*)iterator;
@@ -123,6 +653,11 @@ void logdb_iter_free (logdb_iter* iterator)
 		logdb_buffer_free (iter->value);
 	if (iter->lease.connection)
 		logdb_lease_release (&iter->lease);
+	logdb_buffer_free (iter->block);
+	logdb_buffer_free (iter->map);
+	free (iter->records);
+	free (iter->seen);
+	free (iter->snapshot.entries);
 	iter->connection = NULL;
 	free (iterator);
 }
\ No newline at end of file
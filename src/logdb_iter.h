@@ -7,13 +7,46 @@
 #include "logdb_lease.h"
 #include "logdb_data.h"
 
+/**
+ * The `end` of an iterator that goes on to the end of the log, however long it gets.
+ */
+#define LOGDB_ITER_NO_END ((logdb_size_t)~0)
+
 typedef struct {
 	logdb_connection_t* connection;
 	logdb_lease_t lease;
+	logdb_size_t start; /**< index of the first log entry to read */
+	logdb_size_t end; /**< index of the log entry to stop before, or `LOGDB_ITER_NO_END`. Reverse iterators read backwards from here, moving it down as they go */
 
 	logdb_data_header_t record; /**< header for current record */
+	logdb_size_t frame_len; /**< number of bytes left in the current frame after the current record */
 	logdb_buffer_t* key;
 	logdb_buffer_t* value;
+
+	/* Only used by iterators created with `logdb_iter_all` */
+	logdb_buffer_t* block; /**< buffer owning an aligned section's worth of bytes read from the db file, which keys and values point into */
+	off_t window_offset; /**< offset in the db file where the data in `block` starts */
+	size_t window_len; /**< number of bytes in `block` that are valid for the current lease */
+
+	/* Only used by iterators created with `logdb_iter_reverse` */
+	bool reverse;
+	off_t* records; /**< offsets in the current lease of the records not yet returned, in the order they were written */
+	size_t records_len; /**< number of offsets in `records` */
+	size_t records_size; /**< number of offsets `records` has room for */
+
+	/* Only used by iterators created with `logdb_iter_snapshot` */
+	logdb_log_snapshot_t snapshot; /**< the log as it was when the iterator was created */
+
+	/* Only used by iterators created with `logdb_iter_follow` */
+	bool follow;
+	logdb_size_t* seen; /**< for each section, the number of bytes of it that we've read */
+	size_t seen_len; /**< number of sections in `seen` */
+	unsigned int commits; /**< number of commits (see `logdb_shm_commits`) when we last started looking from the first section */
+
+	/* Only used by iterators created with `logdb_iter_mapped` */
+	logdb_buffer_t* map; /**< buffer owning the current mapping of the db file, which keys and values point into */
+	const char* map_addr; /**< start of the current mapping */
+	size_t map_len; /**< number of bytes mapped, which may be past the end of the file */
 } logdb_iter_t;
 
 /**
@@ -1,6 +1,7 @@
 #include "logdb_lease.h"
 #include "logdb_io.h"
 
+#include <stdlib.h>
 #include <pthread.h>
 #include <string.h>
 #include <unistd.h>
@@ -11,11 +12,50 @@ static bool logdb_lease_read_entry_space (logdb_log_t* log, logdb_log_entry_t* e
 	if (offset == -1)
 		return false;
 
-	/* Check if the entry has enough free space for us */
-	int freespace = LOGDB_SECTION_SIZE - (entry->len);
+	/* Check if the entry has enough free space for us. Sections that are part of a span are never
+	    extended, since we couldn't tell our data apart from an incomplete span's if we crashed. */
+	if (entry->len & (LOGDB_LOG_ENTRY_CONTINUES | LOGDB_LOG_ENTRY_CONTINUATION))
+		return false;
+	int freespace = log->section_size - (entry->len);
 	return (freespace >= size);
 }
 
+/**
+ * Adds the section with the given entry to the free-space index if it has any space left.
+ *  The caller must not hold the section's lock.
+ */
+static void logdb_lease_put_free (logdb_connection_t* conn, logdb_size_t index, const logdb_log_entry_t* entry)
+{
+	if (!(entry->len & (LOGDB_LOG_ENTRY_CONTINUES | LOGDB_LOG_ENTRY_CONTINUATION)) && (entry->len < conn->section_size))
+		logdb_shm_put_free (conn->log->shm, index, conn->section_size - entry->len);
+}
+
+/**
+ * Unlocks the sections covered by the given write lease. If it covers a single section, the section
+ *  is then added to the free-space index, so the next writer can fill it up. The sections of a span
+ *  are only added if the span never made it into the log, or was taken back, so they are empty.
+ */
+static void logdb_lease_unlock (logdb_lease_t* lease)
+{
+	logdb_connection_t* conn = lease->connection;
+	for (logdb_size_t i = 0; i < lease->count; i++)
+		logdb_log_unlock (conn->log, lease->index + i);
+	if (lease->count == 1) {
+		/* N.B. After a failed write, `offset` may be past the end of the committed data.
+		    That's ok; whoever takes the section from the index reads the real length from the log. */
+		logdb_log_entry_t entry;
+		entry.len = lease->offset;
+		logdb_lease_put_free (conn, lease->index, &entry);
+	} else {
+		/* `logdb_lease_put_free` skips the entries of a span that is still there */
+		for (logdb_size_t i = 0; i < lease->count; i++) {
+			logdb_log_entry_t entry;
+			if (logdb_log_read_entry (conn->log, &entry, lease->index + i) != -1)
+				logdb_lease_put_free (conn, lease->index + i, &entry);
+		}
+	}
+}
+
 static int logdb_lease_acquire_prelude (logdb_lease_t* lease, logdb_connection_t* conn)
 {
 	DBGIF(!lease || !conn) {
@@ -44,12 +84,13 @@ int logdb_lease_acqire_read (logdb_lease_t* lease, logdb_connection_t* conn, log
 		more data to be appended to the section after we read this. That
 		data simply won't be a part of this lease.
 	*/
-	logdb_log_entry_t entry;
-	if (logdb_log_read_entry (conn->log, &entry, index) == -1) {
+	logdb_size_t count;
+	off_t len = logdb_log_read_span (conn->log, index, &count);
+	if (len == -1) {
 		pthread_rwlock_unlock (&conn->lock);
 		return -1;
 	}
-	if ((offset < 0) || (offset >= entry.len)) {
+	if ((offset < 0) || (offset >= len)) {
 		LOG("logdb_lease_acqire_read: invalid offset");
 		pthread_rwlock_unlock (&conn->lock);
 		return -1;
@@ -57,23 +98,143 @@ int logdb_lease_acqire_read (logdb_lease_t* lease, logdb_connection_t* conn, log
 
 	lease->connection = conn;
 	lease->index = index;
+	lease->count = count;
 	lease->offset = offset;
-	lease->len = entry.len - offset;
+	lease->len = len - offset;
 	lease->type = LOGDB_LOG_LOCK_NONE;
+	lease->sticky = false;
 	return 0;
 }
 
-int logdb_lease_acquire_write (logdb_lease_t* lease, logdb_connection_t* conn, logdb_size_t size)
+int logdb_lease_acquire_read_span (logdb_lease_t* lease, logdb_connection_t* conn, logdb_size_t index, logdb_size_t count, off_t len)
+{
+	if (logdb_lease_acquire_prelude (lease, conn) != 0)
+		return -1;
+
+	lease->connection = conn;
+	lease->index = index;
+	lease->count = count;
+	lease->offset = 0;
+	lease->len = len;
+	lease->type = LOGDB_LOG_LOCK_NONE;
+	lease->sticky = false;
+	return 0;
+}
+
+/**
+ * Leases a span of new consecutive sections for data larger than a section.
+ *  The caller must already hold the connection lock.
+ */
+static int logdb_lease_acquire_span (logdb_lease_t* lease, logdb_connection_t* conn, logdb_size_t size)
 {
-	if (size > LOGDB_SECTION_SIZE) {
-		LOG("logdb_lease_acquire_write: cannot yet save data > LOGDB_SECTION_SIZE");
+	logdb_size_t count = (size + conn->section_size - 1) / conn->section_size;
+	char* entries = calloc (count, conn->log->entry_size);
+	if (!entries) {
+		ELOG("logdb_lease_acquire_span: calloc");
+		pthread_rwlock_unlock (&conn->lock);
 		return -1;
 	}
+
+	logdb_size_t index = 0, end, locked;
+	logdb_size_t missing = count;
+	bool first = true;
+	off_t offset;
+append:
+	/* Append empty entries for the whole span at once (or, on a retry, for the part of it past the end).
+	    As in `logdb_lease_acquire_write`, another thread may append between our `write` and `lseek`, so
+		the index we compute may not be exactly the entries we wrote. That's ok, as long as we can lock
+		`count` consecutive empty entries. */
+	if (write (conn->log->fd, entries, missing * conn->log->entry_size) < (ssize_t)(missing * conn->log->entry_size)) {
+		ELOG("logdb_lease_acquire_span: write");
+		goto fail;
+	}
+	offset = lseek (conn->log->fd, 0, SEEK_CUR);
+	if (offset < 0) {
+		ELOG("logdb_lease_acquire_span: lseek");
+		goto fail;
+	}
+	end = logdb_log_index_from_offset (conn->log, offset);
+	if (first) {
+		index = end - count;
+		first = false;
+	}
+
+lock:
+	VLOG("logdb_lease_acquire_span: attempting to acquire lease of sections %d-%d", index, index + count - 1);
+
+	for (locked = 0; locked < count; locked++) {
+		logdb_log_entry_t entry;
+		if (logdb_log_lock (conn->log, index + locked) != 0)
+			break;
+		if ((logdb_log_read_entry (conn->log, &entry, index + locked) == -1) || (entry.len != 0)) {
+			logdb_log_unlock (conn->log, index + locked);
+			break;
+		}
+	}
+	if (locked < count) {
+		/* Someone beat us to one of the sections. The empty ones before it are no good to us, since the
+		    span has to be consecutive, so put them in the free-space index for others, and try again
+			past it, appending only as many entries as we are then short. */
+		logdb_log_entry_t empty;
+		empty.len = 0;
+		for (logdb_size_t i = 0; i < locked; i++)
+			logdb_log_unlock (conn->log, index + i);
+		for (logdb_size_t i = 0; i < locked; i++)
+			logdb_lease_put_free (conn, index + i, &empty);
+		index += locked + 1;
+		if ((index + count) <= end)
+			goto lock;
+		missing = (index + count) - end;
+		goto append;
+	}
+	free (entries);
+	(void)logdb_connection_reserve (conn, index + count);
+
+	lease->connection = conn;
+	lease->index = index;
+	lease->count = count;
+	lease->offset = 0;
+	lease->len = size;
+	lease->type = LOGDB_LOG_LOCK_WRITE;
+	lease->sticky = false;
+	return 0;
+fail:
+	free (entries);
+	pthread_rwlock_unlock (&conn->lock);
+	return -1;
+}
+
+int logdb_lease_acquire_write (logdb_lease_t* lease, logdb_connection_t* conn, logdb_size_t size)
+{
 	if (logdb_lease_acquire_prelude (lease, conn) != 0)
 		return -1;
+	if (size > conn->section_size)
+		return logdb_lease_acquire_span (lease, conn, size);
 
 	/* Next we need to find an applicable section of the db file to lease..
-	    We first check the last few entries to see if there's space, otherwise just append.
+	    We first ask the free-space index for a section with enough room. The index may be out of date,
+		so once we have the lock on a section, we check its entry. If someone else holds the lock,
+		they will put the section back in the index when they are done.
+		*/
+	off_t offset = -1;
+	logdb_size_t index;
+	logdb_log_entry_t entry;
+	unsigned int visited = 0;
+
+	while (logdb_shm_take_free (conn->log->shm, size, &index) == 0) {
+		if (logdb_log_lock (conn->log, index) != 0)
+			continue;
+		entry.len = conn->section_size; /* in case we can't read it */
+		if (logdb_lease_read_entry_space (conn->log, &entry, index, size)) {
+			offset = entry.len;
+			goto locked;
+		}
+		logdb_log_unlock (conn->log, index);
+		logdb_lease_put_free (conn, index, &entry);
+	}
+
+	/* Sections that were locked by a process that died never made it back into the index,
+	    so we then check the last few entries to see if there's space, otherwise just append.
 
 		To get at the last entries, we need to find the current end of the file, so we do an `lseek`.
 		Note this won't screw up other threads; worst case one will fail to get the lock and take a walk.
@@ -81,11 +242,6 @@ int logdb_lease_acquire_write (logdb_lease_t* lease, logdb_connection_t* conn, l
 		Also, it's ok if more entries are appended after we read the offset; we will simply traverse
 		some older entries, but it's perfectly valid to try to extend them if we can get their locks.
 		*/
-	off_t offset;
-	logdb_size_t index;
-	logdb_log_entry_t entry;
-	unsigned int visited = 0;
-
 walk:
 	offset = lseek (conn->log->fd, 0, SEEK_END);
 	if (offset == -1) {
@@ -93,15 +249,16 @@ walk:
 		pthread_rwlock_unlock (&conn->lock);
 		return -1;
 	}
-	index = logdb_log_index_from_offset (offset) - visited;
+	/* We pick up where the last walk left off, so that a section that someone keeps locked (e.g. with a
+	    sticky lease) can't send us back to it forever */
+	logdb_size_t end = logdb_log_index_from_offset (conn->log, offset);
 	offset = -1;
-	visited = 0;
-	while ((index--) && (visited++ < LOGDB_LEASE_MAX_WALK)) {
+	while ((visited < LOGDB_LEASE_MAX_WALK) && (visited < end)) {
+		index = end - (++visited);
 		if (logdb_lease_read_entry_space (conn->log, &entry, index, size)) {
 			offset = entry.len;
 			break;
 		}
-		offset = -1;
 	}
 
 	/* If we didn't find any section with enough free space, just append a new one..
@@ -110,8 +267,10 @@ walk:
 	*/
 	if (offset < 0) {
 		/* We first write zero to the index indicating there is no valid data in this section */
+		char raw[LOGDB_LOG_ENTRY_MAX_SIZE];
 		entry.len = 0;
-		if (write (conn->log->fd, &entry, sizeof (logdb_log_entry_t)) < sizeof (logdb_log_entry_t)) {
+		size_t rawsz = logdb_log_encode_entry (conn->log, &entry, raw);
+		if (write (conn->log->fd, raw, rawsz) < (ssize_t)rawsz) {
 			ELOG("logdb_lease_acquire_write: write");
 			pthread_rwlock_unlock (&conn->lock);
 			return -1;
@@ -129,7 +288,7 @@ walk:
 			pthread_rwlock_unlock (&conn->lock);
 			return -1;
 		}
-		index = logdb_log_index_from_offset (offset) - 1;
+		index = logdb_log_index_from_offset (conn->log, offset) - 1;
 		offset = 0;
 		visited = 1; /* skip the last entry if we walk again */
 	}
@@ -138,20 +297,112 @@ walk:
 	VLOG("logdb_lease_acquire_write: attempting to acquire lease of section %d", index);
 
 	/* get the lock */
-	if (logdb_log_lock (conn->log, index, LOGDB_LOG_LOCK_WRITE) != 0) {
-		/* FIXME: Would it ever be possible to loop forever here? */
+	if (logdb_log_lock (conn->log, index) != 0)
 		goto walk;
-	}
 
-	/* now that we have the lock, double check that there is still enough space in the section */
-	if (!logdb_lease_read_entry_space (conn->log, &entry, index, size))
+	/* now that we have the lock, double check that there is still enough space in the section.
+	    Another writer may have extended it since we read the entry, so also refresh our offset. */
+	if (!logdb_lease_read_entry_space (conn->log, &entry, index, size)) {
+		logdb_log_unlock (conn->log, index);
 		goto walk;
+	}
+	offset = entry.len;
+locked:
+	(void)logdb_connection_reserve (conn, index + 1);
 
 	lease->connection = conn;
 	lease->index = index;
+	lease->count = 1;
 	lease->offset = offset;
 	lease->len = size;
 	lease->type = LOGDB_LOG_LOCK_WRITE;
+	lease->sticky = false;
+	return 0;
+}
+
+/**
+ * Every lease allocated for a thread's `sticky_lease_key`, on any connection. Each lease is freed by
+ *  whoever takes it off this list: its thread's destructor, or `logdb_lease_release_all_sticky` when
+ *  its connection is closed. Those two can run at the same time, so this lock can't live in the
+ *  connection, which is freed on close.
+ */
+static pthread_mutex_t logdb_lease_sticky_lock = PTHREAD_MUTEX_INITIALIZER;
+static logdb_lease_t* logdb_lease_sticky_list = NULL; /* protected by `logdb_lease_sticky_lock` */
+
+/**
+ * Takes the given lease off `logdb_lease_sticky_list`. The caller must hold `logdb_lease_sticky_lock`.
+ */
+static void logdb_lease_sticky_unlink (logdb_lease_t* lease)
+{
+	if (lease->prev)
+		lease->prev->next = lease->next;
+	else
+		logdb_lease_sticky_list = lease->next;
+	if (lease->next)
+		lease->next->prev = lease->prev;
+}
+
+/**
+ * Unlocks the section of the given lease, if it is still sticky.
+ */
+static void logdb_lease_unstick (logdb_lease_t* lease)
+{
+	if (!lease->sticky)
+		return;
+	logdb_lease_unlock (lease);
+	lease->sticky = false;
+}
+
+int logdb_lease_acquire_sticky (logdb_lease_t** result, logdb_connection_t* conn, logdb_size_t size)
+{
+	logdb_lease_t* lease = (logdb_lease_t*)pthread_getspecific (conn->sticky_lease_key);
+	if (lease && lease->sticky) {
+		if (lease->len >= size) {
+			/* We still hold the section lock, so all we need is the connection lock */
+			if (logdb_lease_acquire_prelude (lease, conn) != 0)
+				return -1;
+			lease->connection = conn;
+			*result = lease;
+			return 0;
+		}
+
+		/* Our section is full; give it up and find another one below */
+		VLOG("logdb_lease_acquire_sticky: section %d is full", lease->index);
+		logdb_lease_unstick (lease);
+	}
+
+	if (!lease) {
+		lease = malloc (sizeof (logdb_lease_t));
+		if (!lease) {
+			ELOG("logdb_lease_acquire_sticky: malloc");
+			return -1;
+		}
+		int err = pthread_setspecific (conn->sticky_lease_key, lease);
+		if (err) {
+			LOG("logdb_lease_acquire_sticky: pthread_setspecific: %s", strerror(err));
+			free (lease);
+			return -1;
+		}
+		lease->sticky = false;
+		lease->owner = conn;
+		lease->thread = pthread_self ();
+		lease->prev = NULL;
+		pthread_mutex_lock (&logdb_lease_sticky_lock);
+		lease->next = logdb_lease_sticky_list;
+		if (lease->next)
+			lease->next->prev = lease;
+		logdb_lease_sticky_list = lease;
+		pthread_mutex_unlock (&logdb_lease_sticky_lock);
+	}
+
+	if (logdb_lease_acquire_write (lease, conn, size) != 0)
+		return -1;
+
+	/* Claim the rest of the section */
+	lease->len = conn->section_size - lease->offset;
+	lease->sticky = true;
+
+	*result = lease;
 	return 0;
 }
 
@@ -166,7 +417,7 @@ size_t logdb_lease_read (logdb_lease_t* lease, void* buf, logdb_size_t len)
 		return len;
 	}
 
-	off_t offset = logdb_connection_offset (lease->index) + lease->offset;
+	off_t offset = logdb_connection_offset (lease->connection, lease->index) + lease->offset;
 	size_t notread = logdb_io_pread (lease->connection->fd, buf, len, offset);
 	size_t bytes = len - notread;
 
@@ -175,6 +426,53 @@ size_t logdb_lease_read (logdb_lease_t* lease, void* buf, logdb_size_t len)
 	return notread;
 }
 
+/**
+ * Writes the given data at the lease's offset through the connection's `direct_fd`. Direct I/O
+ *  has to write whole blocks from an aligned buffer, so the data is copied into one. Since sections
+ *  are aligned, all the blocks we touch are inside our locked section: the start of the first block
+ *  holds data already committed to the section, which we read back and rewrite unchanged, and
+ *  the end of the last block is free space, which we pad with zeros.
+ * \returns Zero (0) on success. On failure, `len`.
+ */
+static size_t logdb_lease_writev_direct (logdb_lease_t* lease, const struct iovec* iov, int iovcnt, size_t len)
+{
+	int fd = lease->connection->direct_fd;
+	off_t offset = logdb_connection_offset (lease->connection, lease->index) + lease->offset;
+	size_t head = offset % LOGDB_SECTION_ALIGNMENT;
+	size_t alen = ((head + len + LOGDB_SECTION_ALIGNMENT - 1) / LOGDB_SECTION_ALIGNMENT) * LOGDB_SECTION_ALIGNMENT;
+	offset -= head;
+
+	char* staging;
+	int err = posix_memalign ((void**)&staging, LOGDB_SECTION_ALIGNMENT, alen);
+	if (err) {
+		LOG("logdb_lease_writev_direct: posix_memalign: %s", strerror (err));
+		return len;
+	}
+
+	if (head) {
+		/* N.B. A short read is fine; there's nothing to preserve past the end of the file */
+		(void)memset (staging, 0, LOGDB_SECTION_ALIGNMENT);
+		if (logdb_io_pread_once (fd, staging, LOGDB_SECTION_ALIGNMENT, offset) == -1) {
+			ELOG("logdb_lease_writev_direct: pread");
+			free (staging);
+			return len;
+		}
+	}
+
+	char* ix = staging + head;
+	for (int i = 0; i < iovcnt; i++) {
+		(void)memcpy (ix, iov[i].iov_base, iov[i].iov_len);
+		ix += iov[i].iov_len;
+	}
+	(void)memset (ix, 0, (staging + alen) - ix);
+
+	size_t notwritten = logdb_io_pwrite (fd, staging, alen, offset);
+	if (notwritten)
+		ELOG("logdb_lease_writev_direct: pwrite");
+	free (staging);
+	return notwritten? len : 0;
+}
+
 size_t logdb_lease_write (logdb_lease_t* lease, const void* buf, logdb_size_t len)
 {
 	DBGIF(!lease || !buf) {
@@ -186,8 +484,43 @@ size_t logdb_lease_write (logdb_lease_t* lease, const void* buf, logdb_size_t le
 		return len;
 	}
 
-	off_t offset = logdb_connection_offset (lease->index) + lease->offset;
-	size_t notwritten = logdb_io_pwrite (lease->connection->fd, buf, len, offset);
+	size_t notwritten;
+	if (lease->connection->direct_fd != -1) {
+		struct iovec iov = { (void*)buf, len };
+		notwritten = logdb_lease_writev_direct (lease, &iov, 1, len);
+	} else {
+		off_t offset = logdb_connection_offset (lease->connection, lease->index) + lease->offset;
+		notwritten = logdb_io_pwrite (lease->connection->fd, buf, len, offset);
+	}
+	size_t bytes = len - notwritten;
+
+	lease->offset += bytes;
+	lease->len -= bytes;
+	return notwritten;
+}
+
+size_t logdb_lease_writev (logdb_lease_t* lease, struct iovec* iov, int iovcnt)
+{
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	DBGIF(!lease || (iovcnt && !iov)) {
+		LOG("logdb_lease_writev: failed-- lease or iov was NULL");
+		return len;
+	}
+	if (len > lease->len) {
+		LOG("logdb_lease_writev: failed-- len exceeds lease size");
+		return len;
+	}
+
+	size_t notwritten;
+	if (lease->connection->direct_fd != -1) {
+		notwritten = logdb_lease_writev_direct (lease, iov, iovcnt, len);
+	} else {
+		off_t offset = logdb_connection_offset (lease->connection, lease->index) + lease->offset;
+		notwritten = logdb_io_pwritev (lease->connection->fd, iov, iovcnt, offset);
+	}
 	size_t bytes = len - notwritten;
 
 	lease->offset += bytes;
@@ -212,8 +545,62 @@ void logdb_lease_release (logdb_lease_t* lease)
 		LOG("logdb_lease_release: passed invalid lease");
 		return;
 	}
+	if (lease->sticky) {
+		/* Keep the section locked (and `connection` set) for the next commit */
+		pthread_rwlock_unlock (&lease->connection->lock);
+		return;
+	}
 	if (lease->type != LOGDB_LOG_LOCK_NONE)
-		logdb_log_unlock (lease->connection->log, lease->index, lease->type);
+		logdb_lease_unlock (lease);
 	pthread_rwlock_unlock (&lease->connection->lock);
 	lease->connection = NULL;
+}
+
+void logdb_lease_abort (logdb_lease_t* lease)
+{
+	DBGIF(!lease || !(lease->connection)) {
+		LOG("logdb_lease_abort: passed invalid lease");
+		return;
+	}
+	if (lease->sticky) {
+		/* Unsticking already unlocked the section */
+		logdb_lease_unstick (lease);
+		pthread_rwlock_unlock (&lease->connection->lock);
+		lease->connection = NULL;
+		return;
+	}
+	logdb_lease_release (lease);
+}
+
+void logdb_lease_sticky_destruct (void* lease)
+{
+	/* The thread that owned this lease is exiting. If its connection is being closed at the same time,
+	    the lease may already have been freed, so only touch it if it's still on the list. Checking the
+	    thread keeps us from mistaking another thread's lease that was since allocated at the same address. */
+	pthread_mutex_lock (&logdb_lease_sticky_lock);
+	logdb_lease_t* found = logdb_lease_sticky_list;
+	while (found && !((found == (logdb_lease_t*)lease) && pthread_equal (found->thread, pthread_self ())))
+		found = found->next;
+	if (found) {
+		logdb_lease_unstick (found);
+		logdb_lease_sticky_unlink (found);
+	}
+	pthread_mutex_unlock (&logdb_lease_sticky_lock);
+	free (found);
+}
+
+void logdb_lease_release_all_sticky (logdb_connection_t* conn)
+{
+	pthread_mutex_lock (&logdb_lease_sticky_lock);
+	logdb_lease_t* lease = logdb_lease_sticky_list;
+	while (lease) {
+		logdb_lease_t* next = lease->next;
+		if (lease->owner == conn) {
+			logdb_lease_unstick (lease);
+			logdb_lease_sticky_unlink (lease);
+			free (lease);
+		}
+		lease = next;
+	}
+	pthread_mutex_unlock (&logdb_lease_sticky_lock);
 }
\ No newline at end of file
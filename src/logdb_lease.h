@@ -5,6 +5,7 @@
 #include "logdb_connection.h"
 #include "logdb_log.h"
 
+#include <sys/uio.h>
 
 /**
  * The maximum number of log entries to walk backwards to find
@@ -15,12 +16,20 @@
 /**
  * Internal struct that represents a lease on a database section.
  */
-typedef struct {
+typedef struct logdb_lease_t {
 	logdb_connection_t* connection;
 	logdb_size_t index; /**< index of the entry in the log that this lease starts on */
+	logdb_size_t count; /**< number of consecutive sections covered by this lease */
 	off_t offset; /**< offset inside of the section */
 	logdb_size_t len; /**< the number of bytes remaining on the lease */
 	logdb_log_lock_type type; /**< type of lock taken, if any */
+
+	/* Only used for sticky leases (see `logdb_lease_acquire_sticky`) */
+	bool sticky; /**< the section lock is kept when this lease is released */
+	logdb_connection_t* owner; /**< the connection whose `sticky_lease_key` holds this lease */
+	pthread_t thread; /**< the thread whose `sticky_lease_key` holds this lease */
+	struct logdb_lease_t* prev; /**< previous thread lease on any connection, or null */
+	struct logdb_lease_t* next; /**< next thread lease on any connection, or null */
 } logdb_lease_t;
 
 /**
@@ -33,9 +42,22 @@ typedef struct {
  */
 int logdb_lease_acqire_read (logdb_lease_t* lease, logdb_connection_t* conn, logdb_size_t index, off_t offset);
 
+/**
+ * Like `logdb_lease_acqire_read`, but for a span whose length the caller already knows
+ *  (e.g. from a snapshot of the log), so the log is not read.
+ * \param lease The destination for the lease object.
+ * \param conn Connection on which to acquire the lease.
+ * \param index Index of the first section of the span.
+ * \param count Number of sections in the span.
+ * \param len Number of valid bytes in the span.
+ * \returns Zero (0) on success.
+ */
+int logdb_lease_acquire_read_span (logdb_lease_t* lease, logdb_connection_t* conn, logdb_size_t index, logdb_size_t count, off_t len);
+
 /**
  * Acquires a write lease on a section of the database that is large enough to write
- *  the given amount of data.
+ *  the given amount of data. If `size` is larger than the connection's section size, the lease covers
+ *  a span of new consecutive sections (see `logdb_log_read_span`).
  * \param lease The destination for the lease object.
  * \param conn Connection on which to acquire the lease.
  * \param size Number of bytes to lease.
@@ -43,6 +65,19 @@ int logdb_lease_acqire_read (logdb_lease_t* lease, logdb_connection_t* conn, log
  */
 int logdb_lease_acquire_write (logdb_lease_t* lease, logdb_connection_t* conn, logdb_size_t size);
 
+/**
+ * Acquires the calling thread's sticky write lease on the given connection, which must have
+ *  been opened with `LOGDB_OPEN_STICKY_LEASES`. A sticky lease covers the rest of its section and
+ *  keeps the section locked when it is released, so the next call on the same thread can reuse it
+ *  without touching the log. If there is not enough space left in the section for `size` bytes,
+ *  the section is unlocked and a new one is leased.
+ * \param lease The destination for a pointer to the lease object, which is owned by the connection.
+ * \param conn Connection on which to acquire the lease.
+ * \param size Number of bytes to lease.
+ * \returns Zero (0) on success.
+ */
+int logdb_lease_acquire_sticky (logdb_lease_t** lease, logdb_connection_t* conn, logdb_size_t size);
+
 /**
  * Reads data from the leased region of the database file.
  * \param lease The lease from which to read.
@@ -61,6 +96,16 @@ size_t logdb_lease_read (logdb_lease_t* lease, void* buf, logdb_size_t len);
  */
 size_t logdb_lease_write (logdb_lease_t* lease, const void* buf, logdb_size_t len);
 
+/**
+ * Writes the data described by the given iovecs to the leased region of the database file
+ *  with as few system calls as possible. The passed `iov` array is modified.
+ * \param lease The lease to which to write.
+ * \param iov The data to write.
+ * \param iovcnt The number of elements in `iov`.
+ * \returns Zero (0) on success. On failure, the amount of data remaining to be written.
+ */
+size_t logdb_lease_writev (logdb_lease_t* lease, struct iovec* iov, int iovcnt);
+
 /**
  * Seeks within the given lease.
  * \param lease The lease within which to seek.
@@ -71,8 +116,29 @@ off_t logdb_lease_seek (logdb_lease_t* lease, off_t offset);
 
 /**
  * Releases a lease previously acquired with `logdb_lease_acquire`.
+ *  Sticky leases keep their section locked for the next commit on the same thread.
  */
 void logdb_lease_release (logdb_lease_t* lease);
 
+/**
+ * Releases a write lease after a failed write. Unlike `logdb_lease_release`, sticky leases
+ *  also give up their section, since it may now contain partially written data past the
+ *  length recorded in the log.
+ */
+void logdb_lease_abort (logdb_lease_t* lease);
+
+/**
+ * Gives up the given sticky lease and frees it. This is the destructor for the
+ *  connection's `sticky_lease_key`.
+ */
+void logdb_lease_sticky_destruct (void* lease);
+
+/**
+ * Gives up all sticky leases on the given connection and frees them, including those of threads
+ *  that are exiting. The caller must hold the connection's write lock, so that no other thread is
+ *  using them, and must already have deleted the connection's `sticky_lease_key`.
+ */
+void logdb_lease_release_all_sticky (logdb_connection_t* conn);
+
 
 #endif /* LOGDB_LEASE_H */
\ No newline at end of file
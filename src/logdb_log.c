@@ -2,6 +2,8 @@
 #include "logdb_log.h"
 #include "logdb_connection.h"
 #include "logdb_io.h"
+#include "logdb_data.h"
+#include "logdb_crc.h"
 
 #include <stdlib.h>
 #include <fcntl.h>
@@ -11,32 +13,100 @@
 #include <math.h>
 #include <unistd.h>
 #include <stdatomic.h>
+#include <sys/mman.h>
 
-static off_t logdb_log_offset (logdb_size_t index)
+off_t logdb_log_offset (const logdb_log_t* log, logdb_size_t index)
 {
-	return sizeof (logdb_log_header_t) + (index * sizeof (logdb_log_entry_t));
+	return sizeof (logdb_log_header_t) + ((off_t)index * log->entry_size);
 }
 
-logdb_size_t logdb_log_index_from_offset (off_t offset)
+logdb_size_t logdb_log_index_from_offset (const logdb_log_t* log, off_t offset)
 {
 	/* FIXME */
 	if (offset < sizeof (logdb_log_header_t))
 		return 0;
 
-	return (logdb_size_t)((offset - sizeof (logdb_log_header_t)) / sizeof (logdb_log_entry_t));
+	return (logdb_size_t)((offset - sizeof (logdb_log_header_t)) / log->entry_size);
 }
 
-static logdb_log_t* logdb_log_new (int fd, const char* path)
+/**
+ * Returns the size of each log entry in the file for the given section size.
+ */
+static size_t logdb_log_entry_size (logdb_size_t section_size)
+{
+	return (section_size <= LOGDB_LOG_ENTRY_SHORT_MAX_SECTION)? LOGDB_LOG_ENTRY_SHORT_SIZE : sizeof (logdb_log_entry_t);
+}
+
+size_t logdb_log_encode_entry (const logdb_log_t* log, const logdb_log_entry_t* entry, void* buf)
+{
+	if (log->entry_size == LOGDB_LOG_ENTRY_SHORT_SIZE) {
+		uint16_t len = (uint16_t)LOGDB_LOG_ENTRY_LEN(*entry);
+		if (entry->len & LOGDB_LOG_ENTRY_CONTINUES)
+			len |= 0x8000;
+		if (entry->len & LOGDB_LOG_ENTRY_CONTINUATION)
+			len |= 0x4000;
+		(void)memcpy (buf, &len, sizeof (len));
+	} else {
+		(void)memcpy (buf, entry, sizeof (logdb_log_entry_t));
+	}
+	return log->entry_size;
+}
+
+/**
+ * Decodes an entry from the log file. This is the inverse of `logdb_log_encode_entry`.
+ */
+static void logdb_log_decode_entry (const logdb_log_t* log, const void* buf, logdb_log_entry_t* entry)
+{
+	if (log->entry_size == LOGDB_LOG_ENTRY_SHORT_SIZE) {
+		uint16_t len;
+		(void)memcpy (&len, buf, sizeof (len));
+		entry->len = len & 0x3fff;
+		if (len & 0x8000)
+			entry->len |= LOGDB_LOG_ENTRY_CONTINUES;
+		if (len & 0x4000)
+			entry->len |= LOGDB_LOG_ENTRY_CONTINUATION;
+	} else {
+		(void)memcpy (entry, buf, sizeof (logdb_log_entry_t));
+	}
+}
+
+/**
+ * Creates a `logdb_log_t` for the log file at the given path, which is already open on the given fd
+ *  (without O_APPEND). Takes ownership of the fd, closing it on failure.
+ */
+static logdb_log_t* logdb_log_new (int pfd, const char* path, logdb_size_t section_size)
 {
 	logdb_log_t* result = malloc (sizeof (logdb_log_t));
 	if (!result) {
 		ELOG("logdb_log_new: malloc");
+		close (pfd);
+		return NULL;
+	}
+
+	result->fd = open (path, O_RDWR | O_APPEND);
+	if (result->fd == -1) {
+		ELOG("logdb_log_new: open");
+		close (pfd);
+		free (result);
 		return NULL;
 	}
 
-	result->fd = fd;
+	int err = pthread_mutex_init (&result->map_lock, NULL);
+	if (err) {
+		LOG("logdb_log_new: pthread_mutex_init: %s", strerror (err));
+		close (result->fd);
+		close (pfd);
+		free (result);
+		return NULL;
+	}
+
+	result->pfd = pfd;
 	result->path = realpath (path, NULL);
-	result->lock = NULL;
+	result->section_size = section_size;
+	result->entry_size = logdb_log_entry_size (section_size);
+	result->shm = NULL;
+	atomic_init (&result->map, NULL);
+	atomic_init (&result->mapped_size, 0);
 	return result;
 }
 
@@ -104,9 +174,9 @@ static logdb_log_header_t* logdb_log_read (int fd, logdb_log_read_mode mode)
 	return result;
 }
 
-logdb_log_t* logdb_log_open (const char* path)
+logdb_log_t* logdb_log_open (const char* path, logdb_size_t section_size)
 {
-	int fd = open (path, O_RDWR | O_APPEND);
+	int fd = open (path, O_RDWR);
 	if (fd == -1) {
 		LOG("logdb_log_open: open(\"%s\", O_RDWR) failed: %s", path, strerror(errno));
 		return NULL;
@@ -117,10 +187,10 @@ logdb_log_t* logdb_log_open (const char* path)
 		return NULL;
 	}
 
-	return logdb_log_new (fd, path);
+	return logdb_log_new (fd, path, section_size);
 }
 
-logdb_log_t* logdb_log_create (const char* path, int dbfd)
+logdb_log_t* logdb_log_create (const char* path, int dbfd, logdb_size_t section_size)
 {
 	logdb_log_header_t* header = NULL;
 	size_t logsz = sizeof (logdb_log_header_t);
@@ -171,7 +241,7 @@ logdb_log_t* logdb_log_create (const char* path, int dbfd)
 		header->version = LOGDB_VERSION;
 	}
 
-	int logfd = open (path, O_RDWR | O_CREAT | O_EXCL | O_APPEND, S_IRUSR | S_IWUSR);
+	int logfd = open (path, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
 	if (logfd == -1) {
 		ELOG("logdb_log_create: open");
 		free (header);
@@ -199,7 +269,7 @@ logdb_log_t* logdb_log_create (const char* path, int dbfd)
 		goto logwritefail;
 
 	free (header);
-	return logdb_log_new (logfd, path);
+	return logdb_log_new (logfd, path, section_size);
 
 logwritefail:
 	ELOG("logdb_log_create: write");
@@ -210,20 +280,164 @@ logwritefail:
 	return NULL;
 }
 
-off_t logdb_log_read_entry (const logdb_log_t* log, logdb_log_entry_t* buf, logdb_size_t index)
+/**
+ * Checks the size of the log file, because someone wants to read up to the given offset
+ *  past the size we last knew about, and remaps the file if it has outgrown our mapping.
+ * \returns Zero (0) if the file is at least `end` bytes long, -2 if it isn't, or -1 on failure.
+ */
+static int logdb_log_remap (logdb_log_t* log, off_t end)
+{
+	int result = 0;
+	pthread_mutex_lock (&log->map_lock);
+	if (atomic_load (&log->mapped_size) >= end)
+		goto done; /* someone else beat us to it */
+
+	struct stat st;
+	if (fstat (log->pfd, &st) != 0) {
+		ELOG("logdb_log_remap: fstat");
+		result = -1;
+		goto done;
+	}
+	if (st.st_size < end) {
+		result = -2;
+		goto done;
+	}
+
+	logdb_log_map_t* map = atomic_load (&log->map);
+	if (!map || (map->len < (size_t)st.st_size)) {
+		logdb_log_map_t* newmap = malloc (sizeof (logdb_log_map_t));
+		if (!newmap) {
+			ELOG("logdb_log_remap: malloc");
+			result = -1;
+			goto done;
+		}
+		newmap->len = (size_t)st.st_size * 2;
+		if (newmap->len < LOGDB_LOG_MIN_MAP_SIZE)
+			newmap->len = LOGDB_LOG_MIN_MAP_SIZE;
+		void* addr = mmap (NULL, newmap->len, PROT_READ, MAP_SHARED, log->pfd, 0);
+		if (addr == MAP_FAILED) {
+			ELOG("logdb_log_remap: mmap");
+			free (newmap);
+			result = -1;
+			goto done;
+		}
+		newmap->addr = (const char*)addr;
+		newmap->prev = map;
+		atomic_store (&log->map, newmap);
+	}
+
+	/* N.B. This must come after the new mapping is published, so that anyone who sees the new size sees the mapping that covers it */
+	atomic_store (&log->mapped_size, st.st_size);
+done:
+	pthread_mutex_unlock (&log->map_lock);
+	return result;
+}
+
+off_t logdb_log_read_entry (logdb_log_t* log, logdb_log_entry_t* buf, logdb_size_t index)
 {
 	DBGIF(!log || !buf) {
 		LOG("logdb_log_read_entry: failed-- passed log or buf was null");
 		return -1;
 	}
 
-	off_t offset = logdb_log_offset (index);
-	ssize_t result = logdb_io_pread (log->fd, buf, sizeof (logdb_log_entry_t), offset);
-	if (result > 0) {
-		ELOG("logdb_log_read_entry: pread");
+	off_t offset = logdb_log_offset (log, index);
+	off_t end = offset + log->entry_size;
+	if ((atomic_load (&log->mapped_size) < end) && (logdb_log_remap (log, end) != 0))
+		return -1;
+
+	/* Entries are written in place while we may be reading them, so copy it out once rather than decoding from the mapping */
+	char raw[LOGDB_LOG_ENTRY_MAX_SIZE];
+	logdb_log_map_t* map = atomic_load (&log->map);
+	(void)memcpy (raw, map->addr + offset, log->entry_size);
+	logdb_log_decode_entry (log, raw, buf);
+	return offset;
+}
+
+/**
+ * Reads the given entry from the snapshot if there is one, otherwise from the log.
+ * \returns -1 if there is no such entry or on failure, otherwise zero (0).
+ */
+static int logdb_log_entry_at (logdb_log_t* log, const logdb_log_snapshot_t* snapshot, logdb_log_entry_t* buf, logdb_size_t index)
+{
+	if (!snapshot)
+		return (logdb_log_read_entry (log, buf, index) == -1)? -1 : 0;
+	if (index >= snapshot->count)
+		return -1;
+	*buf = snapshot->entries[index];
+	return 0;
+}
+
+/**
+ * Implements `logdb_log_read_span` and `logdb_log_snapshot_span`.
+ */
+static off_t logdb_log_span (logdb_log_t* log, const logdb_log_snapshot_t* snapshot, logdb_size_t index, logdb_size_t* count)
+{
+	logdb_log_entry_t entry;
+	if (logdb_log_entry_at (log, snapshot, &entry, index) == -1)
+		return -1;
+
+	*count = 1;
+	if (entry.len & LOGDB_LOG_ENTRY_CONTINUATION) {
+		/* We've landed in the middle of a span that never got committed */
+		return 0;
+	}
+
+	off_t len = LOGDB_LOG_ENTRY_LEN(entry);
+	logdb_size_t sections = 1;
+	while (entry.len & LOGDB_LOG_ENTRY_CONTINUES) {
+		if ((logdb_log_entry_at (log, snapshot, &entry, index + sections) == -1) || !(entry.len & LOGDB_LOG_ENTRY_CONTINUATION)) {
+			LOG("logdb_log_span: span at %d is incomplete", index);
+			return 0;
+		}
+		len += LOGDB_LOG_ENTRY_LEN(entry);
+		sections++;
+	}
+
+	*count = sections;
+	return len;
+}
+
+off_t logdb_log_read_span (logdb_log_t* log, logdb_size_t index, logdb_size_t* count)
+{
+	return logdb_log_span (log, NULL, index, count);
+}
+
+int logdb_log_snapshot (logdb_log_t* log, logdb_log_snapshot_t* snapshot)
+{
+	struct stat st;
+	if (fstat (log->fd, &st) != 0) {
+		ELOG("logdb_log_snapshot: fstat");
 		return -1;
 	}
-	return (result == -1)? -1 : offset;
+
+	/* N.B. The log never shrinks while it's open, so we can read all of this in one go */
+	logdb_size_t count = logdb_log_index_from_offset (log, st.st_size);
+	char* raw = malloc (((size_t)count * log->entry_size) + 1);
+	snapshot->entries = malloc (((size_t)count * sizeof (logdb_log_entry_t)) + 1);
+	if (!raw || !(snapshot->entries)) {
+		ELOG("logdb_log_snapshot: malloc");
+		goto fail;
+	}
+	if (count && (logdb_io_pread (log->fd, raw, (size_t)count * log->entry_size, logdb_log_offset (log, 0)) != 0)) {
+		ELOG("logdb_log_snapshot: pread");
+		goto fail;
+	}
+
+	for (logdb_size_t i = 0; i < count; i++)
+		logdb_log_decode_entry (log, raw + ((size_t)i * log->entry_size), &snapshot->entries[i]);
+	snapshot->count = count;
+	free (raw);
+	return 0;
+fail:
+	free (raw);
+	free (snapshot->entries);
+	snapshot->entries = NULL;
+	return -1;
+}
+
+off_t logdb_log_snapshot_span (const logdb_log_snapshot_t* snapshot, logdb_size_t index, logdb_size_t* count)
+{
+	return logdb_log_span (NULL, snapshot, index, count);
 }
 
 int logdb_log_write_entry (logdb_log_t* log, logdb_log_entry_t* buf, logdb_size_t index)
@@ -233,116 +447,185 @@ int logdb_log_write_entry (logdb_log_t* log, logdb_log_entry_t* buf, logdb_size_
 		return -1;
 	}
 
-	off_t offset = logdb_log_offset (index);
-	if (logdb_io_pwrite (log->fd, buf, sizeof (logdb_log_entry_t), offset) > 0) {
+	char raw[LOGDB_LOG_ENTRY_MAX_SIZE];
+	size_t size = logdb_log_encode_entry (log, buf, raw);
+	if (logdb_io_pwrite (log->pfd, raw, size, logdb_log_offset (log, index)) > 0) {
 		ELOG("logdb_log_write_entry: pwrite");
 		return -1;
 	}
 	return 0;
 }
 
-static void logdb_log_inproc_unlock (logdb_log_t* log, logdb_size_t index, logdb_log_lock_type type)
+int logdb_log_write_span (logdb_log_t* log, logdb_size_t index, logdb_size_t count, off_t len)
 {
-	/* Since we know we have the lock, this algorithm is a little less tortured than the one to take the lock */
-	volatile logdb_log_lock_t* lock = log->lock;
-	while ((lock->startindex + 127) < index)
-		lock = lock->next;
-
-	logdb_size_t lockindex = index - (lock->startindex);
-	if (type == LOGDB_LOG_LOCK_READ)
-		atomic_fetch_sub (&lock->locks[lockindex], 1);
-	else if (type == LOGDB_LOG_LOCK_WRITE)
-		atomic_fetch_add (&lock->locks[lockindex], 1);
-	else
-		abort();
+	DBGIF(!log || (count < 2)) {
+		LOG("logdb_log_write_span: failed-- passed log was null or count was less than 2");
+		return -1;
+	}
+
+	char* entries = malloc (count * log->entry_size);
+	if (!entries) {
+		ELOG("logdb_log_write_span: malloc");
+		return -1;
+	}
+	for (logdb_size_t i = 0; i < count; i++) {
+		logdb_log_entry_t entry;
+		entry.len = (i < (count - 1))? log->section_size : (logdb_size_t)(len - ((count - 1) * (off_t)log->section_size));
+		if (i > 0)
+			entry.len |= LOGDB_LOG_ENTRY_CONTINUATION;
+		if (i < (count - 1))
+			entry.len |= LOGDB_LOG_ENTRY_CONTINUES;
+		(void)logdb_log_encode_entry (log, &entry, entries + (i * log->entry_size));
+	}
+
+	/* Write the continuation entries first. Until the first entry is written, they are ignored. */
+	int result = 0;
+	size_t tailsz = (count - 1) * log->entry_size;
+	if (logdb_io_pwrite (log->pfd, entries + log->entry_size, tailsz, logdb_log_offset (log, index + 1)) > 0) {
+		ELOG("logdb_log_write_span: pwrite 1");
+		result = -1;
+	} else if (logdb_io_pwrite (log->pfd, entries, log->entry_size, logdb_log_offset (log, index)) > 0) {
+		ELOG("logdb_log_write_span: pwrite 2");
+		result = -1;
+	}
+
+	if (result != 0) {
+		/* Don't leave orphaned continuations around; they would keep anyone else from using those sections */
+		(void)memset (entries, 0, count * log->entry_size);
+		(void)logdb_io_pwrite (log->pfd, entries + log->entry_size, tailsz, logdb_log_offset (log, index + 1));
+	}
+	free (entries);
+	return result;
 }
 
-int logdb_log_lock (logdb_log_t* log, logdb_size_t index, logdb_log_lock_type type)
+/**
+ * Returns the number of bytes at the start of the given data, read from the start of the given section,
+ *  that are made up of valid frames.
+ */
+static off_t logdb_log_valid_frames (logdb_size_t index, const char* data, off_t len)
 {
-	/* We MUST obtain our in-proc lock on the applicable section BEFORE
-		attempting to take the `fcntl` lock. Otherwise, a different thread
-		might inadvertently unlock us.
-	 */
-	volatile _Atomic(logdb_log_lock_t*)* dest = &log->lock;
-	logdb_log_lock_t* lock = atomic_load (dest);
-
-tryagain1:
-	if (!lock || (lock->startindex > index)) {
-		logdb_log_lock_t* newlock = (logdb_log_lock_t*)calloc (1, sizeof (logdb_log_lock_t));
-		if (!newlock) {
-			ELOG("logdb_log_lock: calloc");
-			return -1;
+	off_t valid = 0;
+	while ((len - valid) >= (off_t)sizeof (logdb_data_frame_t)) {
+		logdb_data_frame_t frame;
+		(void)memcpy (&frame, data + valid, sizeof (frame));
+		if ((frame.len == 0) || (frame.len > (len - valid - sizeof (frame))))
+			break;
+
+		uint32_t crc = logdb_crc32c_frame (index, (logdb_size_t)valid, frame.len);
+		crc = logdb_crc32c (crc, data + valid + sizeof (frame), frame.len);
+		if (crc != frame.crc)
+			break;
+		valid += sizeof (frame) + frame.len;
+	}
+	return valid;
+}
+
+int logdb_log_recover (logdb_log_t* log, int dbfd)
+{
+	int result = 0;
+	bool repaired = false;
+	char* data = NULL;
+	off_t datasz = 0;
+
+	logdb_log_entry_t entry;
+	for (logdb_size_t index = 0; logdb_log_read_entry (log, &entry, index) != -1; ) {
+		if (entry.len == 0) {
+			index++;
+			continue;
 		}
-		newlock->startindex = index;
-		atomic_init (&newlock->next, lock);
-
-		/* FIXME: Benchmark if atomic_compare_exchange_weak is more performant
-		     (I assumend it wasn't, due to the `newlock` reallocation on loop) */
-		if (!atomic_compare_exchange_strong (dest, &lock, newlock)) {
-			free (newlock);
-			goto tryagain1;
+
+		logdb_size_t count;
+		off_t len = logdb_log_read_span (log, index, &count);
+		if (len == -1)
+			break;
+		if (len == 0) {
+			/* An incomplete span, or a continuation without one. Nobody else can use this section as long as it's flagged. */
+			VLOG("logdb_log_recover: freeing section %d", index);
+			entry.len = 0;
+			if (logdb_log_write_entry (log, &entry, index) != 0)
+				goto fail;
+			repaired = true;
+			index++;
+			continue;
 		}
-        lock = newlock;
-	}
 
-	logdb_size_t lockindex = index - (lock->startindex);
-	if (lockindex > 127) {
-		dest = &lock->next;
-		lock = atomic_load (dest);
-		goto tryagain1;
-	}
+		if (len > datasz) {
+			char* newdata = realloc (data, len);
+			if (!newdata) {
+				ELOG("logdb_log_recover: realloc");
+				goto fail;
+			}
+			data = newdata;
+			datasz = len;
+		}
+		if (logdb_io_pread (dbfd, data, len, LOGDB_SECTION_OFFSET(log->section_size, index)) != 0) {
+			/* N.B. This includes hitting the end of the file, which means the data never made it there */
+			(void)memset (data, 0, len);
+		}
 
-	/* Now that we have the correct structure, attempt to lock it */
-	int value;
-	struct flock flk;
-	value = lock->locks[lockindex];
-tryagain2:
-	if ((type == LOGDB_LOG_LOCK_READ) && (value >= 0)) {
-		/* Take a read lock 
-			FIXME: Prevent overflow!
-		*/
-		if (!atomic_compare_exchange_weak (&lock->locks[lockindex], &value, value + 1))
-			goto tryagain2;
-		flk.l_type = F_RDLCK;
-	} else if ((type == LOGDB_LOG_LOCK_WRITE) && (value == 0)) {
-		/* Take a write lock */
-		if (!atomic_compare_exchange_weak (&lock->locks[lockindex], &value, -1))
-			goto tryagain2;
-		flk.l_type = F_WRLCK;
-	} else {
-		/* We can't take any lock :( */
-		return -2;
+		off_t valid = logdb_log_valid_frames (index, data, len);
+		if (valid < len) {
+			LOG("logdb_log_recover: discarding %lld bytes that failed validation in section %d", (long long)(len - valid), index);
+			if (count > 1) {
+				/* A span holds a single frame, so it's all or nothing. Free the tail before the head, as in `logdb_log_write_span`. */
+				entry.len = 0;
+				for (logdb_size_t i = count; i-- > 0; ) {
+					if (logdb_log_write_entry (log, &entry, index + i) != 0)
+						goto fail;
+				}
+			} else {
+				entry.len = valid;
+				if (logdb_log_write_entry (log, &entry, index) != 0)
+					goto fail;
+			}
+			repaired = true;
+		}
+		index += count;
 	}
 
-	/* Now we've locked this entry at the process level, we need to take
-	    an `fcntl` lock on the section of the file to synchronize across processes */
-	flk.l_whence = SEEK_SET;
-	flk.l_start = logdb_log_offset (index);
-	flk.l_len = sizeof (logdb_log_entry_t);
-	flk.l_pid = getpid();
-	if (fcntl (log->fd, F_SETLK, &flk) == -1) {
-		if (errno != EAGAIN)
-			ELOG("logdb_log_lock: fcntl");
-		logdb_log_inproc_unlock (log, index, type);
-		return -3;
+	if (repaired && (fsync (log->pfd) != 0)) {
+		ELOG("logdb_log_recover: fsync");
+		result = -1;
 	}
+	free (data);
+	return result;
+fail:
+	free (data);
+	return -1;
+}
 
-	/* We have the lock! */
-	return 0;
+int logdb_log_index_free (logdb_log_t* log)
+{
+	/* Read the entries a page at a time rather than one by one, since there may be a lot of them */
+	char raw[4096];
+	size_t batch = sizeof (raw) / log->entry_size;
+	logdb_size_t index = 0;
+	while (1) {
+		ssize_t len = logdb_io_pread_once (log->fd, raw, batch * log->entry_size, logdb_log_offset (log, index));
+		if (len == -1) {
+			ELOG("logdb_log_index_free: pread");
+			return -1;
+		}
+		if (len < (ssize_t)log->entry_size)
+			return 0;
+
+		for (const char* ix = raw; ix + log->entry_size <= raw + len; ix += log->entry_size, index++) {
+			logdb_log_entry_t entry;
+			logdb_log_decode_entry (log, ix, &entry);
+			if (!(entry.len & (LOGDB_LOG_ENTRY_CONTINUES | LOGDB_LOG_ENTRY_CONTINUATION)) && (entry.len < log->section_size))
+				logdb_shm_put_free (log->shm, index, log->section_size - entry.len);
+		}
+	}
 }
 
-void logdb_log_unlock (logdb_log_t* log, logdb_size_t index, logdb_log_lock_type type)
+int logdb_log_lock (logdb_log_t* log, logdb_size_t index)
 {
-	struct flock flk;
-	flk.l_type = F_UNLCK;
-	flk.l_whence = SEEK_SET;
-	flk.l_start = logdb_log_offset (index);
-	flk.l_len = sizeof (logdb_log_entry_t);
-	flk.l_pid = getpid();
-	if (fcntl (log->fd, F_SETLK, &flk) == -1)
-		ELOG("logdb_log_unlock: fcntl");
+	return logdb_shm_lock (log->shm, index);
+}
 
-	logdb_log_inproc_unlock (log, index, type);
+void logdb_log_unlock (logdb_log_t* log, logdb_size_t index)
+{
+	logdb_shm_unlock (log->shm, index);
 }
 
 int logdb_log_close (logdb_log_t* log)
@@ -351,6 +634,17 @@ int logdb_log_close (logdb_log_t* log)
 		LOG("logdb_log_close: failed-- passed log was null");
 		return -1;
 	}
+	if (log->shm)
+		logdb_shm_close (log->shm);
+	logdb_log_map_t* map = atomic_load (&log->map);
+	while (map) {
+		logdb_log_map_t* prev = map->prev;
+		munmap ((void*)map->addr, map->len);
+		free (map);
+		map = prev;
+	}
+	pthread_mutex_destroy (&log->map_lock);
+	close (log->pfd);
 	close (log->fd);
 	if (log->path)
 		free (log->path);
@@ -394,16 +688,18 @@ int logdb_log_close_merge (logdb_log_t* log, int dbfd)
 	}
 
 	/* Let's figure out the min size of the db and truncate to there */
-	logdb_size_t sections = logdb_log_index_from_offset (logsz);
-	off_t minsz = logdb_connection_offset (sections);
+	logdb_size_t sections = logdb_log_index_from_offset (log, logsz);
+	off_t minsz = LOGDB_SECTION_OFFSET(log->section_size, sections);
 
 	/* See if we can trim any more from the end */
-	logdb_log_entry_t* entries = (logdb_log_entry_t*)(header + 1);
+	/* N.B. The entries follow the header unaligned, so copy them out rather than dereferencing */
+	const char* entries = (const char*)(header + 1);
 	for (unsigned int i = 1; i <= sections; i++) {
-		logdb_log_entry_t entry = entries [sections - i];
-		minsz -= LOGDB_SECTION_SIZE - entry.len;
+		logdb_log_entry_t entry;
+		logdb_log_decode_entry (log, entries + ((sections - i) * log->entry_size), &entry);
+		minsz -= log->section_size - LOGDB_LOG_ENTRY_LEN(entry);
 		if (entry.len == 0)
-			logsz -= sizeof (logdb_log_entry_t);
+			logsz -= log->entry_size;
 		else
 			break;
 	}
@@ -430,6 +726,8 @@ int logdb_log_close_merge (logdb_log_t* log, int dbfd)
 
 	/* It doesn't really matter if this fails; next open will detect the log and deal with it */
 	unlink (log->path);
+	if (log->shm)
+		logdb_shm_unlink (log->shm);
 
 	return logdb_log_close (log);
 failunlock:
@@ -2,8 +2,10 @@
 #define LOGDB_LOG_H
 
 #include "logdb_internal.h"
+#include "logdb_shm.h"
 
 #include <sys/types.h>
+#include <pthread.h>
 #include <stdatomic.h>
 
 /**
@@ -19,41 +21,38 @@
 
 typedef enum {
 	LOGDB_LOG_LOCK_NONE,
-	LOGDB_LOG_LOCK_READ,
 	LOGDB_LOG_LOCK_WRITE
 } logdb_log_lock_type;
 
 /**
- * Internal structure representing a reader/writer lock on
- *  entries in the log file.
- *
- * Although we use `fcntl` locks to lock the relevant portions of
- *  the file, these apply across the whole process. Thus, we need
- *  to roll our own to protect multithreaded access.
- */
-typedef struct logdb_log_lock_t {
-	logdb_size_t startindex;
-
-	/**
-	 * A set of locks. Index 0 corresponds to `startindex`, with
-	 *  each subsequent index being the next section in the log.
-	 *
-	 * For each entry, 0 indicates no lock is taken, a positive value
-	 *  indicates the number of read locks taken, and -1 indicates a
-	 *  write lock is taken.
-	 */
-	volatile atomic_int locks[128];
-
-	/**
-	 * If we run out of locks above, we simply append another structure here.
-	 */
-	volatile _Atomic(struct logdb_log_lock_t*) next;
-} logdb_log_lock_t;
+ * The smallest length of the mapping of the log file (see `logdb_log_map_t`).
+ */
+#define LOGDB_LOG_MIN_MAP_SIZE 65536 /* bytes */
+
+/**
+ * Internal struct for a read-only mapping of the log file, through which entries are read.
+ *  Since the log only grows while it is open, a mapping stays valid until the log is closed.
+ *  The log is mapped past its end, so appended entries show up without remapping until the
+ *  mapping is outgrown. Then it is replaced by one twice the size of the file, but kept around,
+ *  since other threads may still be reading through it.
+ */
+typedef struct logdb_log_map_t {
+	const char* addr;
+	size_t len; /* number of bytes mapped, which may be past the end of the file */
+	struct logdb_log_map_t* prev; /* the mapping this one replaced, or null */
+} logdb_log_map_t;
 
 typedef struct {
-	int fd;
+	int fd; /* opened with O_APPEND, so that appending entries is atomic */
+	int pfd; /* for writing entries in place, since on Linux `pwrite` ignores the offset when O_APPEND is set */
 	char* path; /* needed to unlink log */
-	volatile _Atomic(logdb_log_lock_t*) lock;
+	logdb_size_t section_size; /* size of the database sections described by the entries */
+	size_t entry_size; /* size of each entry in the file (see `logdb_log_encode_entry`) */
+	logdb_shm_t* shm; /* locks on the entries, shared by every process with the log open */
+
+	pthread_mutex_t map_lock; /* serializes remapping */
+	volatile _Atomic(logdb_log_map_t*) map; /* current mapping of the log file, or null */
+	volatile atomic_llong mapped_size; /* size the file was known to have when last checked; never past the end of `map` */
 } logdb_log_t;
 
 typedef struct {
@@ -64,39 +63,126 @@ typedef struct {
 } logdb_log_header_t;
 
 /**
- * Internal struct that holds an entry in the log file.
+ * Internal struct that holds an entry in the log file. In the file, entries take
+ *  `LOGDB_LOG_ENTRY_SHORT_SIZE` bytes if the section size fits in them, otherwise
+ *  `LOGDB_LOG_ENTRY_MAX_SIZE` bytes (see `logdb_log_encode_entry`).
  */
 typedef struct {
-	unsigned short len; /**< number of bytes that are valid in this section */
+	logdb_size_t len; /**< number of bytes that are valid in this section, combined with the flags below */
 } logdb_log_entry_t;
 
+/**
+ * The size of a log entry in the file for databases with small sections, whose flags are
+ *  stored in the top two bits of 16 rather than 32.
+ */
+#define LOGDB_LOG_ENTRY_SHORT_SIZE 2
+
+/**
+ * The largest section size for which log entries are `LOGDB_LOG_ENTRY_SHORT_SIZE` bytes.
+ */
+#define LOGDB_LOG_ENTRY_SHORT_MAX_SECTION 0x3fff
+
+/**
+ * The largest size of a log entry in the file.
+ */
+#define LOGDB_LOG_ENTRY_MAX_SIZE sizeof (logdb_log_entry_t)
+
+/**
+ * Flag set in `logdb_log_entry_t.len` if the data in this section continues into the next one.
+ *  Such a section is always full.
+ */
+#define LOGDB_LOG_ENTRY_CONTINUES 0x80000000u
+
+/**
+ * Flag set in `logdb_log_entry_t.len` if this section holds the continuation of data from the
+ *  previous section. Such sections are only valid if the previous section has `LOGDB_LOG_ENTRY_CONTINUES`.
+ */
+#define LOGDB_LOG_ENTRY_CONTINUATION 0x40000000u
+
+/**
+ * Returns the number of valid bytes in the section for the given `logdb_log_entry_t`, without any flags.
+ */
+#define LOGDB_LOG_ENTRY_LEN(entry) ((entry).len & ~(LOGDB_LOG_ENTRY_CONTINUES | LOGDB_LOG_ENTRY_CONTINUATION))
+
+/**
+ * Returns the offset in the log file of the entry with the given index.
+ */
+off_t logdb_log_offset (const logdb_log_t* log, logdb_size_t index);
+
 /**
  * Returns the entry index associated with the given offset into the log file.
  */
-logdb_size_t logdb_log_index_from_offset (off_t offset);
+logdb_size_t logdb_log_index_from_offset (const logdb_log_t* log, off_t offset);
+
+/**
+ * Encodes the given entry as it is stored in the log file.
+ * \param buf A buffer of at least `LOGDB_LOG_ENTRY_MAX_SIZE` bytes.
+ * \returns The number of bytes written to `buf`, which is the log's `entry_size`.
+ */
+size_t logdb_log_encode_entry (const logdb_log_t* log, const logdb_log_entry_t* entry, void* buf);
 
 /**
  * Opens the log file at the given path.
+ * \param section_size The section size of the database the log belongs to.
  * \returns The log, or NULL if it could not be opened.
  */
-logdb_log_t* logdb_log_open (const char* path);
+logdb_log_t* logdb_log_open (const char* path, logdb_size_t section_size);
 
 /**
  * Creates an log file for the database file open on the given fd.
  * \param path The path at which to create the log.
  * \param dbfd The file descriptor for the database for which to create the log.
+ * \param section_size The section size of the database.
  * \returns The log, or NULL if it could not be created.
  */
-logdb_log_t* logdb_log_create (const char* path, int dbfd);
+logdb_log_t* logdb_log_create (const char* path, int dbfd, logdb_size_t section_size);
 
 /**
- * Reads the given entry from the log.
+ * Reads the given entry from the log. The entry is read through the mapping of the log,
+ *  so this only makes a system call if the entry is past the end of the file as we last saw it.
  * \param log The log from which to read.
  * \param buf The buffer into which the entry will be read.
  * \param index Zero-based index of the entry to read.
  * \returns -1 on failure, otherwise the offset in the log file of the entry.
  */
-off_t logdb_log_read_entry (const logdb_log_t* log, logdb_log_entry_t* buf, logdb_size_t index);
+off_t logdb_log_read_entry (logdb_log_t* log, logdb_log_entry_t* buf, logdb_size_t index);
+
+/**
+ * Reads the span of sections that starts at the given index.
+ *  A span is a run of consecutive sections whose data is contiguous, written by a single commit
+ *  that was too large for one section. All but the last entry of a span have `LOGDB_LOG_ENTRY_CONTINUES`,
+ *  and all but the first have `LOGDB_LOG_ENTRY_CONTINUATION`. A section that is not part of a span
+ *  is a span of one section.
+ * \param log The log from which to read.
+ * \param index Zero-based index of the first entry of the span.
+ * \param count Set to the number of sections in the span. If the span is incomplete or the entry at `index`
+ *  is a continuation of another span, this is set to one (1) and zero (0) is returned, since that section
+ *  should be skipped.
+ * \returns -1 on failure (e.g. there is no entry at `index`), otherwise the number of valid bytes in the span.
+ */
+off_t logdb_log_read_span (logdb_log_t* log, logdb_size_t index, logdb_size_t* count);
+
+/**
+ * Internal struct for a copy of every entry in the log at a point in time (see `logdb_log_snapshot`).
+ */
+typedef struct {
+	logdb_log_entry_t* entries;
+	logdb_size_t count; /* number of entries */
+} logdb_log_snapshot_t;
+
+/**
+ * Copies every entry in the log, reading them all at once.
+ * \param log The log from which to read.
+ * \param snapshot Set to the entries. The caller must free `snapshot->entries`.
+ * \returns Zero (0) on success.
+ */
+int logdb_log_snapshot (logdb_log_t* log, logdb_log_snapshot_t* snapshot);
+
+/**
+ * Like `logdb_log_read_span`, but reads the span from the given snapshot of the log.
+ * \returns -1 if there is no entry at `index` in the snapshot, otherwise the number of valid bytes in the span.
+ */
+off_t logdb_log_snapshot_span (const logdb_log_snapshot_t* snapshot, logdb_size_t index, logdb_size_t* count);
 
 /**
  * Writes the given entry to the log. This entry should be locked.
@@ -108,21 +194,50 @@ off_t logdb_log_read_entry (const logdb_log_t* log, logdb_log_entry_t* buf, logd
 int logdb_log_write_entry (logdb_log_t* log, logdb_log_entry_t* buf, logdb_size_t index);
 
 /**
- * Attempts to acquire the given lock on the given entry in the log.
+ * Writes the entries for a span of sections to the log (see `logdb_log_read_span`). All of the entries
+ *  should be locked. The first entry is written last, so that readers never see an incomplete span.
+ * \param log The log to which to write.
+ * \param index Zero-based index of the first entry of the span.
+ * \param count Number of sections in the span. Must be greater than one (1).
+ * \param len Number of valid bytes in the span.
+ * \returns Zero (0) on success.
+ */
+int logdb_log_write_span (logdb_log_t* log, logdb_size_t index, logdb_size_t count, off_t len);
+
+/**
+ * Attempts to write-lock the given entry in the log (see `logdb_shm_lock`).
+ *  The log's `shm` must be set.
  * \param log The log.
  * \param index The index of the entry to lock.
- * \param type The type of lock to acquire.
  * \returns Zero (0) if the lock was acquired.
  */
-int logdb_log_lock (logdb_log_t* log, logdb_size_t index, logdb_log_lock_type type);
+int logdb_log_lock (logdb_log_t* log, logdb_size_t index);
 
 /**
- * Unlocks the given lock on the given entry in the log.
+ * Unlocks the given entry in the log.
  * \param log The log.
  * \param index The index of the entry to unlock.
- * \param type The type of lock to remove.
  */
-void logdb_log_unlock (logdb_log_t* log, logdb_size_t index, logdb_log_lock_type type);
+void logdb_log_unlock (logdb_log_t* log, logdb_size_t index);
+
+/**
+ * Validates the data in the database file against the given log after a crash, discarding
+ *  any frames that fail their checksum (see `logdb_data_frame_t`), along with anything after them
+ *  in the same section, and freeing the sections of incomplete spans. This reads the whole database,
+ *  and must only be called while no other process has the database open.
+ * \param log The log, which was left behind by a process that did not close the database.
+ * \param dbfd The file descriptor for the database.
+ * \returns Zero (0) on success.
+ */
+int logdb_log_recover (logdb_log_t* log, int dbfd);
+
+/**
+ * Adds every section with free space to the free-space index in the log's shared memory,
+ *  which must have just been reset (see `logdb_shm_put_free`).
+ * \param log The log.
+ * \returns Zero (0) on success.
+ */
+int logdb_log_index_free (logdb_log_t* log);
 
 /**
  * Closes the given log.
@@ -0,0 +1,547 @@
+#ifdef __linux__
+#  define _GNU_SOURCE /* for F_OFD_SETLK */
+#endif
+
+#include "logdb_shm.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#  include <linux/futex.h>
+#  include <sys/syscall.h>
+#endif
+
+/* The slots and bitmaps are shared between processes, which only works if the atomics on them don't need a lock */
+#if (ATOMIC_INT_LOCK_FREE != 2) || (ATOMIC_LLONG_LOCK_FREE != 2)
+#  error "logdb_shm requires lock-free atomic ints and long longs"
+#endif
+
+_Static_assert (sizeof (logdb_shm_header_t) <= LOGDB_SHM_LIVENESS(0), "logdb_shm header overlaps the liveness locks");
+
+#define LOGDB_SHM_BIT(n) (1ULL << ((n) % 64))
+
+/* Open file description locks are only released when the last fd for the open file is closed, rather
+    than when the process closes any fd for the file, and they conflict between openers in the same process */
+#ifdef F_OFD_SETLK
+#  define LOGDB_SHM_SETLK F_OFD_SETLK
+#  define LOGDB_SHM_GETLK F_OFD_GETLK
+#else
+#  define LOGDB_SHM_SETLK F_SETLK
+#  define LOGDB_SHM_GETLK F_GETLK
+#endif
+
+/**
+ * Serializes growing shared memory files within this process. The file lock we take for it doesn't
+ *  conflict with our own process's locks, even through another connection's fd.
+ */
+static pthread_mutex_t logdb_shm_grow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifndef F_OFD_SETLK
+/**
+ * Internal struct for a shared memory file opened by this process, where OFD locks are not available.
+ *  Closing any fd for a file then drops every lock the process holds on it, including the liveness
+ *  locks of the process's other connections, so they all share one fd, which stays open until the last
+ *  of them closes it.
+ */
+typedef struct logdb_shm_file_t {
+	struct logdb_shm_file_t* next;
+	dev_t dev;
+	ino_t ino;
+	int fd;
+	unsigned int refs; /* number of connections using `fd` */
+} logdb_shm_file_t;
+
+static pthread_mutex_t logdb_shm_files_lock = PTHREAD_MUTEX_INITIALIZER;
+static logdb_shm_file_t* logdb_shm_files = NULL; /* protected by `logdb_shm_files_lock` */
+#endif
+
+/**
+ * Opens the shared memory file at the given path, or, where OFD locks are not available, returns the
+ *  fd this process already has open for it.
+ * \returns The fd, or -1 on failure.
+ */
+static int logdb_shm_open_fd (const char* path)
+{
+#ifdef F_OFD_SETLK
+	return open (path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+#else
+	pthread_mutex_lock (&logdb_shm_files_lock);
+	struct stat st;
+	logdb_shm_file_t* file = NULL;
+	if (stat (path, &st) == 0) {
+		for (file = logdb_shm_files; file; file = file->next) {
+			if ((file->dev == st.st_dev) && (file->ino == st.st_ino)) {
+				file->refs++;
+				break;
+			}
+		}
+	}
+	if (!file) {
+		int fd = open (path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+		if ((fd != -1) && ((fstat (fd, &st) != 0) || !(file = malloc (sizeof (logdb_shm_file_t))))) {
+			ELOG("logdb_shm_open_fd");
+			close (fd);
+			fd = -1;
+		}
+		if (fd == -1) {
+			pthread_mutex_unlock (&logdb_shm_files_lock);
+			return -1;
+		}
+		file->dev = st.st_dev;
+		file->ino = st.st_ino;
+		file->fd = fd;
+		file->refs = 1;
+		file->next = logdb_shm_files;
+		logdb_shm_files = file;
+	}
+	pthread_mutex_unlock (&logdb_shm_files_lock);
+	return file->fd;
+#endif
+}
+
+/**
+ * Closes an fd returned by `logdb_shm_open_fd`, or, where it is shared, drops our reference to it.
+ */
+static void logdb_shm_close_fd (int fd)
+{
+#ifndef F_OFD_SETLK
+	pthread_mutex_lock (&logdb_shm_files_lock);
+	for (logdb_shm_file_t** file = &logdb_shm_files; *file; file = &(*file)->next) {
+		if ((*file)->fd != fd)
+			continue;
+		logdb_shm_file_t* found = *file;
+		if (--found->refs > 0) {
+			pthread_mutex_unlock (&logdb_shm_files_lock);
+			return;
+		}
+		*file = found->next;
+		free (found);
+		break;
+	}
+	pthread_mutex_unlock (&logdb_shm_files_lock);
+#endif
+	close (fd);
+}
+
+/**
+ * Fills in a lock of the liveness byte of the given owner id.
+ */
+static void logdb_shm_liveness_lock (struct flock* flk, unsigned int id)
+{
+	/* N.B. OFD locks require `l_pid` to be zero */
+	(void)memset (flk, 0, sizeof (*flk));
+	flk->l_type = F_WRLCK;
+	flk->l_whence = SEEK_SET;
+	flk->l_start = LOGDB_SHM_LIVENESS(id);
+	flk->l_len = 1;
+}
+
+/**
+ * Claims the first owner id that nobody else holds, by locking its liveness byte until the file is closed.
+ * \returns Zero (0) on success.
+ */
+static int logdb_shm_claim (logdb_shm_t* shm)
+{
+	for (unsigned int id = 1; id < LOGDB_SHM_MAX_OWNERS; id++) {
+#ifndef F_OFD_SETLK
+		/* Without OFD locks, our own locks never conflict with each other, so skip the ids we already hold */
+		if (atomic_load (&shm->header->pids[id]) == getpid ())
+			continue;
+#endif
+		struct flock flk;
+		logdb_shm_liveness_lock (&flk, id);
+		if (fcntl (shm->fd, LOGDB_SHM_SETLK, &flk) == -1) {
+			if ((errno == EACCES) || (errno == EAGAIN))
+				continue;
+			ELOG("logdb_shm_claim: fcntl");
+			return -1;
+		}
+
+		/* Start a new generation, so the slots left locked by whoever had this id before are not mistaken for ours */
+		unsigned int generation = (atomic_fetch_add (&shm->header->generations[id], 1) + 1) & LOGDB_SHM_GENERATION_MASK;
+		atomic_store (&shm->header->pids[id], getpid ());
+		shm->owner = (int)((generation << LOGDB_SHM_OWNER_BITS) | id);
+		return 0;
+	}
+	LOG("logdb_shm_claim: failed-- the database is open too many times");
+	return -1;
+}
+
+logdb_shm_t* logdb_shm_open (const char* path, bool reset)
+{
+	logdb_shm_t* shm = calloc (1, sizeof (logdb_shm_t));
+	if (!shm) {
+		ELOG("logdb_shm_open: calloc");
+		return NULL;
+	}
+
+	shm->fd = logdb_shm_open_fd (path);
+	if (shm->fd == -1) {
+		ELOG("logdb_shm_open: open");
+		free (shm);
+		return NULL;
+	}
+
+	if (reset) {
+		/* Throw away the locks and free space of everyone that had the database open before */
+		if ((ftruncate (shm->fd, 0) != 0) || (ftruncate (shm->fd, LOGDB_SHM_HEADER_SIZE) != 0)) {
+			ELOG("logdb_shm_open: reset");
+			goto closefail;
+		}
+	}
+
+	void* map = mmap (NULL, LOGDB_SHM_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+	if (map == MAP_FAILED) {
+		ELOG("logdb_shm_open: mmap");
+		goto closefail;
+	}
+	shm->header = (logdb_shm_header_t*)map;
+
+	if (reset) {
+		(void)memcpy (shm->header->magic, LOGDB_SHM_MAGIC, sizeof (shm->header->magic));
+		shm->header->version = LOGDB_SHM_VERSION;
+	} else if ((memcmp (shm->header->magic, LOGDB_SHM_MAGIC, sizeof (shm->header->magic)) != 0)
+		|| (shm->header->version != LOGDB_SHM_VERSION)) {
+		LOG("logdb_shm_open: failed to validate shm header");
+		munmap (map, LOGDB_SHM_HEADER_SIZE);
+		goto closefail;
+	}
+
+	if (logdb_shm_claim (shm) != 0) {
+		munmap (map, LOGDB_SHM_HEADER_SIZE);
+		goto closefail;
+	}
+
+	shm->path = realpath (path, NULL);
+	return shm;
+closefail:
+	logdb_shm_close_fd (shm->fd);
+	free (shm);
+	return NULL;
+}
+
+/**
+ * Returns the given chunk, growing the file and mapping it if this is the first time we need it.
+ */
+static logdb_shm_chunk_t* logdb_shm_chunk (logdb_shm_t* shm, logdb_size_t chunk)
+{
+	if (chunk >= LOGDB_SHM_MAX_CHUNKS) {
+		LOG("logdb_shm_chunk: failed-- too many sections");
+		return NULL;
+	}
+
+	logdb_shm_chunk_t* mapped = atomic_load (&shm->chunks[chunk]);
+	if (mapped)
+		return mapped;
+
+	/* Make sure the file covers the chunk. Other threads and processes may be doing the same thing,
+	    so we take both an in-process and a file lock, lest anyone shrink the file after we've grown it. */
+	off_t end = LOGDB_SHM_HEADER_SIZE + ((off_t)(chunk + 1) * LOGDB_SHM_CHUNK_SIZE);
+	struct flock flk;
+	flk.l_type = F_WRLCK;
+	flk.l_whence = SEEK_SET;
+	flk.l_start = 0;
+	flk.l_len = sizeof (logdb_shm_header_t);
+	flk.l_pid = getpid();
+
+	pthread_mutex_lock (&logdb_shm_grow_lock);
+	if (fcntl (shm->fd, F_SETLKW, &flk) == -1) {
+		ELOG("logdb_shm_chunk: fcntl");
+		pthread_mutex_unlock (&logdb_shm_grow_lock);
+		return NULL;
+	}
+	struct stat st;
+	int result = fstat (shm->fd, &st);
+	if ((result == 0) && (st.st_size < end))
+		result = ftruncate (shm->fd, end);
+	if (result != 0)
+		ELOG("logdb_shm_chunk: ftruncate");
+	flk.l_type = F_UNLCK;
+	(void)fcntl (shm->fd, F_SETLK, &flk);
+	pthread_mutex_unlock (&logdb_shm_grow_lock);
+	if (result != 0)
+		return NULL;
+
+	void* map = mmap (NULL, LOGDB_SHM_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, end - LOGDB_SHM_CHUNK_SIZE);
+	if (map == MAP_FAILED) {
+		ELOG("logdb_shm_chunk: mmap");
+		return NULL;
+	}
+
+	/* If another thread mapped it first, use theirs */
+	if (!atomic_compare_exchange_strong (&shm->chunks[chunk], &mapped, (logdb_shm_chunk_t*)map))
+		munmap (map, LOGDB_SHM_CHUNK_SIZE);
+	else
+		mapped = (logdb_shm_chunk_t*)map;
+	return mapped;
+}
+
+/**
+ * Returns the lock slot for the section with the given index in the given chunk.
+ *  Consecutive sections are spread across `LOGDB_SHM_SLOTS_PER_LINE` cache lines, so that writers
+ *  locking neighboring sections don't contend for the same line.
+ */
+static volatile atomic_int* logdb_shm_slot (logdb_shm_chunk_t* chunk, logdb_size_t index)
+{
+	logdb_size_t slot = index % LOGDB_SHM_CHUNK_SLOTS;
+	logdb_size_t stride = LOGDB_SHM_CHUNK_SLOTS / LOGDB_SHM_SLOTS_PER_LINE;
+	return &chunk->slots[((slot % LOGDB_SHM_SLOTS_PER_LINE) * stride) + (slot / LOGDB_SHM_SLOTS_PER_LINE)];
+}
+
+/**
+ * Returns true if the given owner of a slot has closed the file or died, or if its id has since been claimed again.
+ */
+static bool logdb_shm_owner_dead (logdb_shm_t* shm, int owner)
+{
+	unsigned int id = (unsigned int)owner & LOGDB_SHM_OWNER_MASK;
+	unsigned int generation = (unsigned int)owner >> LOGDB_SHM_OWNER_BITS;
+	if (id == 0)
+		return true;
+	if ((atomic_load (&shm->header->generations[id]) & LOGDB_SHM_GENERATION_MASK) != generation)
+		return true;
+
+#ifndef F_OFD_SETLK
+	/* Without OFD locks, we can't see the locks of our own process, but we know we're alive */
+	if (atomic_load (&shm->header->pids[id]) == getpid ())
+		return false;
+#endif
+	/* N.B. If someone claims the id between our two checks, they hold the lock and we think the owner is alive,
+	    which only means we don't take over its slot this time */
+	struct flock flk;
+	logdb_shm_liveness_lock (&flk, id);
+	if (fcntl (shm->fd, LOGDB_SHM_GETLK, &flk) == -1) {
+		ELOG("logdb_shm_owner_dead: fcntl");
+		return false;
+	}
+	return flk.l_type == F_UNLCK;
+}
+
+int logdb_shm_lock (logdb_shm_t* shm, logdb_size_t index)
+{
+	logdb_shm_chunk_t* chunk = logdb_shm_chunk (shm, index / LOGDB_SHM_CHUNK_SLOTS);
+	if (!chunk)
+		return -1;
+
+	volatile atomic_int* slot = logdb_shm_slot (chunk, index);
+	int owner = 0;
+	while (!atomic_compare_exchange_strong (slot, &owner, shm->owner)) {
+		/* If the owner died, try to take the lock over from them. Other threads sharing our
+		    owner are obviously alive, so we don't need to ask the kernel about them. */
+		if (owner == 0)
+			continue;
+		if ((owner == shm->owner) || !logdb_shm_owner_dead (shm, owner))
+			return -2;
+		VLOG("logdb_shm_lock: owner %d died holding section %d", owner & LOGDB_SHM_OWNER_MASK, index);
+	}
+	return 0;
+}
+
+void logdb_shm_unlock (logdb_shm_t* shm, logdb_size_t index)
+{
+	/* The chunk must already be mapped, since we locked it */
+	logdb_shm_chunk_t* chunk = atomic_load (&shm->chunks[index / LOGDB_SHM_CHUNK_SLOTS]);
+	atomic_store (logdb_shm_slot (chunk, index), 0);
+}
+
+/**
+ * Returns `floor(log2(n))`, or zero if `n` is zero.
+ */
+static unsigned int logdb_shm_log2 (logdb_size_t n)
+{
+	return n? (unsigned int)(sizeof (unsigned int) * 8 - 1 - __builtin_clz (n)) : 0;
+}
+
+/**
+ * Clears the given bit in a summary bitmap after the words it summarizes were found to be empty.
+ *  Someone may have set a bit in them in the meantime, so we check again afterward and put the bit
+ *  back if so. That way, a set bit below is always reachable from the summary.
+ */
+static void logdb_shm_clear_summary (volatile atomic_ullong* summary, unsigned int bit, volatile atomic_ullong* words, unsigned int count)
+{
+	(void)atomic_fetch_and (summary, ~LOGDB_SHM_BIT(bit));
+	for (unsigned int i = 0; i < count; i++) {
+		if (atomic_load (&words[i])) {
+			(void)atomic_fetch_or (summary, LOGDB_SHM_BIT(bit));
+			return;
+		}
+	}
+}
+
+void logdb_shm_put_free (logdb_shm_t* shm, logdb_size_t index, logdb_size_t free)
+{
+	if (!free)
+		return;
+
+	unsigned int cls = logdb_shm_log2 (free);
+	unsigned int chunkno = index / LOGDB_SHM_CHUNK_SLOTS;
+	unsigned int word = (index % LOGDB_SHM_CHUNK_SLOTS) / 64;
+	logdb_shm_chunk_t* chunk = logdb_shm_chunk (shm, chunkno);
+	if (!chunk)
+		return; /* the section just won't be reused */
+
+	/* Set the bits from the bottom up, so anyone who finds a bit set above will find one below */
+	(void)atomic_fetch_or (&chunk->free[cls][word], LOGDB_SHM_BIT(index));
+	(void)atomic_fetch_or (&chunk->summary[cls][word / 64], LOGDB_SHM_BIT(word));
+	(void)atomic_fetch_or (&shm->header->free[cls][chunkno / 64], LOGDB_SHM_BIT(chunkno));
+
+	unsigned int chunks = atomic_load (&shm->header->chunks);
+	while ((chunks <= chunkno) && !atomic_compare_exchange_weak (&shm->header->chunks, &chunks, chunkno + 1));
+}
+
+/**
+ * Takes a section out of the given size class of the given chunk.
+ * \returns Zero (0) if a section was found, otherwise -1.
+ */
+static int logdb_shm_take_from_chunk (logdb_shm_chunk_t* chunk, unsigned int cls, logdb_size_t* index)
+{
+	volatile atomic_ullong* summary = chunk->summary[cls];
+	volatile atomic_ullong* free = chunk->free[cls];
+	for (unsigned int i = 0; i < (LOGDB_SHM_CHUNK_SLOTS / 4096); i++) {
+		unsigned long long words = atomic_load (&summary[i]);
+		while (words) {
+			unsigned int word = (i * 64) + __builtin_ctzll (words);
+			words &= words - 1;
+
+			unsigned long long bits = atomic_load (&free[word]);
+			while (bits) {
+				unsigned long long bit = bits & -bits;
+				unsigned long long old = atomic_fetch_and (&free[word], ~bit);
+				if (old & bit) {
+					if (old == bit)
+						logdb_shm_clear_summary (&summary[i], word, &free[word], 1);
+					*index = (word * 64) + __builtin_ctzll (bit);
+					return 0;
+				}
+				/* Someone else took it first */
+				bits = old & ~bit;
+			}
+			logdb_shm_clear_summary (&summary[i], word, &free[word], 1);
+		}
+	}
+	return -1;
+}
+
+int logdb_shm_take_free (logdb_shm_t* shm, logdb_size_t size, logdb_size_t* index)
+{
+	/* Start at the smallest class where every section is big enough */
+	unsigned int cls = logdb_shm_log2 (size);
+	if (size > (1U << cls))
+		cls++;
+
+	unsigned int words = (atomic_load (&shm->header->chunks) + 63) / 64;
+	for (; cls < LOGDB_SHM_FREE_CLASSES; cls++) {
+		volatile atomic_ullong* summary = shm->header->free[cls];
+		for (unsigned int i = 0; i < words; i++) {
+			unsigned long long chunks = atomic_load (&summary[i]);
+			while (chunks) {
+				unsigned int chunkno = (i * 64) + __builtin_ctzll (chunks);
+				chunks &= chunks - 1;
+
+				logdb_shm_chunk_t* chunk = logdb_shm_chunk (shm, chunkno);
+				if (!chunk)
+					continue;
+				if (logdb_shm_take_from_chunk (chunk, cls, index) == 0) {
+					*index += chunkno * LOGDB_SHM_CHUNK_SLOTS;
+					return 0;
+				}
+				logdb_shm_clear_summary (&summary[i], chunkno, chunk->summary[cls], LOGDB_SHM_CHUNK_SLOTS / 4096);
+			}
+		}
+	}
+	return -1;
+}
+
+unsigned int logdb_shm_commits (logdb_shm_t* shm)
+{
+	return atomic_load (&shm->header->commits);
+}
+
+void logdb_shm_notify (logdb_shm_t* shm)
+{
+	/* N.B. This must come before we check for waiters, which check `commits` after counting themselves,
+	    so that either they see this commit or we see them */
+	atomic_fetch_add (&shm->header->commits, 1);
+	if (!atomic_load (&shm->header->waiters))
+		return;
+#ifdef __linux__
+	/* Not FUTEX_PRIVATE_FLAG, since the waiters may be in other processes */
+	if (syscall (SYS_futex, &shm->header->commits, FUTEX_WAKE, INT_MAX, NULL, NULL, 0) == -1)
+		ELOG("logdb_shm_notify: futex");
+#endif
+}
+
+/**
+ * Returns the number of milliseconds left until the given deadline on the monotonic clock.
+ */
+static long long logdb_shm_millis_left (const struct timespec* deadline)
+{
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return ((deadline->tv_sec - now.tv_sec) * 1000LL) + ((deadline->tv_nsec - now.tv_nsec) / 1000000L);
+}
+
+int logdb_shm_wait (logdb_shm_t* shm, unsigned int commits, int millis)
+{
+	struct timespec deadline;
+	clock_gettime (CLOCK_MONOTONIC, &deadline);
+	if (millis > 0) {
+		deadline.tv_sec += millis / 1000;
+		deadline.tv_nsec += (millis % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	int result = 0;
+	atomic_fetch_add (&shm->header->waiters, 1);
+	while (atomic_load (&shm->header->commits) == commits) {
+		long long left = (millis < 0)? -1 : logdb_shm_millis_left (&deadline);
+		if ((millis >= 0) && (left <= 0)) {
+			result = -2;
+			break;
+		}
+#ifdef __linux__
+		/* This only sleeps if `commits` still hasn't changed, and wakes up on any commit by any process */
+		struct timespec timeout = { left / 1000, (left % 1000) * 1000000L };
+		if ((syscall (SYS_futex, &shm->header->commits, FUTEX_WAIT, commits, (left < 0)? NULL : &timeout, NULL, 0) == -1)
+			&& (errno != EAGAIN) && (errno != EINTR) && (errno != ETIMEDOUT)) {
+			ELOG("logdb_shm_wait: futex");
+			result = -1;
+			break;
+		}
+#else
+		/* Without a futex, poll */
+		struct timespec timeout = { 0, 1000000L };
+		nanosleep (&timeout, NULL);
+#endif
+	}
+	atomic_fetch_sub (&shm->header->waiters, 1);
+	return result;
+}
+
+void logdb_shm_unlink (logdb_shm_t* shm)
+{
+	if (shm->path)
+		(void)unlink (shm->path);
+}
+
+void logdb_shm_close (logdb_shm_t* shm)
+{
+	for (int i = 0; i < LOGDB_SHM_MAX_CHUNKS; i++) {
+		logdb_shm_chunk_t* chunk = atomic_load (&shm->chunks[i]);
+		if (chunk)
+			munmap (chunk, LOGDB_SHM_CHUNK_SIZE);
+	}
+	munmap (shm->header, LOGDB_SHM_HEADER_SIZE);
+	logdb_shm_close_fd (shm->fd);
+	free (shm->path);
+	free (shm);
+}
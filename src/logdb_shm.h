@@ -0,0 +1,215 @@
+#ifndef LOGDB_SHM_H
+#define LOGDB_SHM_H
+
+#include "logdb_internal.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/**
+ * The suffix applied to the database file name to derive the
+ * shared memory file name.
+ */
+#define LOGDB_SHM_FILE_SUFFIX "-shm"
+
+/**
+ * The magic cookie appearing at byte 0 of the shared memory file.
+ */
+#define LOGDB_SHM_MAGIC "LDBS"
+
+/**
+ * The version of the layout of the shared memory file. Processes using different
+ *  layouts can't have the same database open at the same time.
+ */
+#define LOGDB_SHM_VERSION 5
+
+/**
+ * The number of sections whose locks are kept in each chunk of the shared memory file.
+ *  Chunks are mapped one at a time, as sections are leased. Must be a multiple of 4096.
+ */
+#define LOGDB_SHM_CHUNK_SLOTS 16384
+
+/**
+ * The maximum number of chunks in the shared memory file, and thus the number of sections
+ *  that can be locked is `LOGDB_SHM_CHUNK_SLOTS * LOGDB_SHM_MAX_CHUNKS`. Must be a multiple of 64.
+ */
+#define LOGDB_SHM_MAX_CHUNKS 4096
+
+/**
+ * The maximum number of times the database can be open at the same time, across all processes.
+ *  Each `logdb_shm_t` claims an owner id below this for the values it stores in the slots.
+ */
+#define LOGDB_SHM_MAX_OWNERS 1024
+
+/**
+ * The number of low bits of a slot value that hold the owner id. The remaining bits hold the
+ *  generation of that id (see `logdb_shm_t`).
+ */
+#define LOGDB_SHM_OWNER_BITS 10
+#define LOGDB_SHM_OWNER_MASK ((1U << LOGDB_SHM_OWNER_BITS) - 1)
+#define LOGDB_SHM_GENERATION_MASK ((1U << (31 - LOGDB_SHM_OWNER_BITS)) - 1)
+
+/**
+ * The offset in the shared memory file of the byte that the owner with the given id keeps
+ *  locked for as long as it has the file open. These are past the end of `logdb_shm_header_t`.
+ */
+#define LOGDB_SHM_LIVENESS(id) ((off_t)(LOGDB_SHM_ALIGNMENT - LOGDB_SHM_MAX_OWNERS + (id)))
+
+/**
+ * The number of lock slots that fit in a cache line. Slots are interleaved so that this many
+ *  consecutive sections, which are the ones most likely to be locked at the same time by
+ *  different writers, each have their slot in a different cache line (see `logdb_shm_slot`).
+ */
+#define LOGDB_SHM_SLOTS_PER_LINE (64 / sizeof (atomic_int))
+
+/**
+ * The number of size classes in the free-space index. A section with `n` free bytes
+ *  is in class `floor(log2(n))`.
+ */
+#define LOGDB_SHM_FREE_CLASSES 32
+
+/**
+ * The alignment of the header and chunks in the shared memory file. This must be
+ *  a multiple of the page size on every platform, since they are mapped separately.
+ */
+#define LOGDB_SHM_ALIGNMENT 65536 /* bytes */
+
+#define LOGDB_SHM_ALIGN(size) ((((size) + LOGDB_SHM_ALIGNMENT - 1) / LOGDB_SHM_ALIGNMENT) * LOGDB_SHM_ALIGNMENT)
+
+typedef struct {
+	char magic[sizeof(LOGDB_SHM_MAGIC) - 1]; /* LOGDB_SHM_MAGIC */
+	unsigned short version; /* LOGDB_SHM_VERSION */
+
+	volatile atomic_uint chunks; /**< number of chunks that have ever had free space */
+	volatile atomic_uint commits; /**< number of commits made since the file was reset, which followers wait on to change */
+	volatile atomic_uint waiters; /**< number of threads waiting for `commits` to change */
+
+	/** For each owner id, the number of times it has been claimed (see `logdb_shm_t`) */
+	volatile atomic_uint generations[LOGDB_SHM_MAX_OWNERS];
+
+	/** For each owner id, the pid of the process that last claimed it, where OFD locks are not available */
+	volatile atomic_int pids[LOGDB_SHM_MAX_OWNERS];
+
+	/**
+	 * For each size class, a bitmap of the chunks that have free sections in that class.
+	 *  A set bit may be out of date, but a clear bit never is.
+	 */
+	volatile atomic_ullong free[LOGDB_SHM_FREE_CLASSES][LOGDB_SHM_MAX_CHUNKS / 64];
+} logdb_shm_header_t;
+
+/**
+ * The layout of a chunk in the shared memory file.
+ */
+typedef struct {
+	/** For each section, the owner (see `logdb_shm_t`) that has it locked, or zero, interleaved by `logdb_shm_slot` */
+	volatile atomic_int slots[LOGDB_SHM_CHUNK_SLOTS];
+
+	/**
+	 * For each size class, a bitmap of the sections in that class that are free for the taking.
+	 *  Sections are added when a writer releases them and taken out by the next writer that claims them,
+	 *  so a set bit may be out of date if the section has since been written through other means.
+	 */
+	volatile atomic_ullong free[LOGDB_SHM_FREE_CLASSES][LOGDB_SHM_CHUNK_SLOTS / 64];
+
+	/** For each size class, a bitmap of the nonzero words of `free` */
+	volatile atomic_ullong summary[LOGDB_SHM_FREE_CLASSES][LOGDB_SHM_CHUNK_SLOTS / 4096];
+} logdb_shm_chunk_t;
+
+#define LOGDB_SHM_HEADER_SIZE LOGDB_SHM_ALIGN(sizeof (logdb_shm_header_t))
+#define LOGDB_SHM_CHUNK_SIZE LOGDB_SHM_ALIGN(sizeof (logdb_shm_chunk_t))
+
+/**
+ * Internal struct for the table of section locks and free space shared by every process that
+ *  has the database open, kept in a file mapped into each of them (`<db>-shm`).
+ *
+ * Each section has a slot holding the owner that has it locked, or zero. Threads and processes
+ *  take a lock with a single compare-and-swap on its slot, without a system call.
+ *
+ * Since the kernel doesn't release these locks when a process dies, each opener of the file claims
+ *  an owner id by taking a file lock on a byte of the file reserved for that id (see `LOGDB_SHM_LIVENESS`),
+ *  which it holds until it closes the file. The kernel does release that one, so a slot whose owner's
+ *  byte is no longer locked is treated as free. Ids are reused, so each claim also starts a new generation
+ *  of the id, and a slot holding an older generation is treated as free as well. Unlike pids, this works
+ *  across pid namespaces and is not fooled when a pid is reused. Where available, these are OFD locks,
+ *  which also tell apart several openers in the same process. Elsewhere, the openers in a process share
+ *  one fd for the file, since closing any fd for it would drop the process's locks.
+ *
+ * Sections with free space are indexed by size class in bitmaps, with a summary bitmap per
+ *  chunk and one for the whole file, so a writer can find a section that fits by scanning a
+ *  few words at each level.
+ */
+typedef struct {
+	int fd;
+	char* path; /* needed to unlink the file */
+	int owner; /* the value we store in the slots we lock: our owner id and its generation */
+	logdb_shm_header_t* header; /* mapped header */
+	volatile _Atomic(logdb_shm_chunk_t*) chunks[LOGDB_SHM_MAX_CHUNKS]; /* mapped chunks, or null */
+} logdb_shm_t;
+
+/**
+ * Opens the shared memory file at the given path, creating it if needed.
+ * \param reset If true, any existing locks are cleared. This must only be done while
+ *  no other process has the database open.
+ * \returns The shared memory, or NULL on failure.
+ */
+logdb_shm_t* logdb_shm_open (const char* path, bool reset);
+
+/**
+ * Attempts to lock the section with the given index for writing.
+ * \returns Zero (0) if the lock was acquired, -2 if it is held by someone else, or -1 on failure.
+ */
+int logdb_shm_lock (logdb_shm_t* shm, logdb_size_t index);
+
+/**
+ * Unlocks the section with the given index, which must have been locked with `logdb_shm_lock`.
+ */
+void logdb_shm_unlock (logdb_shm_t* shm, logdb_size_t index);
+
+/**
+ * Adds the section with the given index to the free-space index. The caller must not hold its lock,
+ *  lest another writer find it and give up on it because it is locked.
+ * \param free The number of free bytes in the section.
+ */
+void logdb_shm_put_free (logdb_shm_t* shm, logdb_size_t index, logdb_size_t free);
+
+/**
+ * Finds a section that had at least the given number of bytes free when it was added to the
+ *  free-space index, and takes it out of the index. The section is not locked, and the caller
+ *  must check that it still has enough space once it is.
+ * \param index Set to the index of the section.
+ * \returns Zero (0) if a section was found, otherwise -1.
+ */
+int logdb_shm_take_free (logdb_shm_t* shm, logdb_size_t size, logdb_size_t* index);
+
+/**
+ * Returns the number of commits made to the database by all processes, modulo 2^32.
+ *  Pass this to `logdb_shm_wait` to wait for the next one.
+ */
+unsigned int logdb_shm_commits (logdb_shm_t* shm);
+
+/**
+ * Counts a commit, and wakes up everyone waiting for one in `logdb_shm_wait`. This makes
+ *  a system call only if someone is waiting.
+ */
+void logdb_shm_notify (logdb_shm_t* shm);
+
+/**
+ * Waits until the number of commits is no longer `commits` (see `logdb_shm_commits`),
+ *  which may already be the case.
+ * \param millis The longest time to wait in milliseconds, or -1 to wait indefinitely.
+ * \returns Zero (0) if there was a commit, -2 if the timeout expired first, or -1 on failure.
+ */
+int logdb_shm_wait (logdb_shm_t* shm, unsigned int commits, int millis);
+
+/**
+ * Removes the shared memory file. The shared memory stays usable until it is closed.
+ */
+void logdb_shm_unlink (logdb_shm_t* shm);
+
+/**
+ * Unmaps and closes the given shared memory.
+ */
+void logdb_shm_close (logdb_shm_t* shm);
+
+#endif /* LOGDB_SHM_H */
@@ -0,0 +1,289 @@
+#ifdef __linux__
+#  define _GNU_SOURCE /* for sync_file_range */
+#endif
+
+#include "logdb_sync.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/time.h>
+
+static int logdb_sync_fd (logdb_sync_t* sync)
+{
+#if defined(_POSIX_SYNCHRONIZED_IO) && (_POSIX_SYNCHRONIZED_IO > 0)
+	if (sync->datasync)
+		return fdatasync (sync->fd);
+#endif
+	return fsync (sync->fd);
+}
+
+int logdb_sync_init (logdb_sync_t* sync, int fd, bool datasync)
+{
+	int err = pthread_mutex_init (&sync->mutex, NULL);
+	if (err) {
+		LOG("logdb_sync_init: pthread_mutex_init: %s", strerror (err));
+		return -1;
+	}
+	err = pthread_cond_init (&sync->cond, NULL);
+	if (err) {
+		LOG("logdb_sync_init: pthread_cond_init: %s", strerror (err));
+		pthread_mutex_destroy (&sync->mutex);
+		return -1;
+	}
+	sync->fd = fd;
+	sync->datasync = datasync;
+	sync->pending = NULL;
+	sync->syncing = false;
+	sync->started = false;
+	sync->stopping = false;
+	return 0;
+}
+
+/**
+ * Takes the queued waiters as a batch, syncs, and completes them. The mutex must be held and no sync
+ *  may be in progress; it is released during the sync.
+ */
+static void logdb_sync_lead (logdb_sync_t* sync)
+{
+	logdb_sync_waiter_t* batch = sync->pending;
+	sync->pending = NULL;
+	sync->syncing = true;
+	pthread_mutex_unlock (&sync->mutex);
+
+	int result = logdb_sync_fd (sync);
+	if (result == -1)
+		ELOG("logdb_sync_lead: fsync");
+
+	pthread_mutex_lock (&sync->mutex);
+	sync->syncing = false;
+	for (; batch; batch = batch->next) {
+		batch->result = result;
+		batch->done = true;
+	}
+	pthread_cond_broadcast (&sync->cond);
+}
+
+static void* logdb_sync_main (void* arg)
+{
+	logdb_sync_t* sync = (logdb_sync_t*)arg;
+	pthread_mutex_lock (&sync->mutex);
+	while (!sync->stopping) {
+		if (sync->pending && !sync->syncing)
+			logdb_sync_lead (sync);
+		else
+			pthread_cond_wait (&sync->cond, &sync->mutex);
+	}
+	pthread_mutex_unlock (&sync->mutex);
+	return NULL;
+}
+
+/**
+ * Queues the given waiter for the next batch. The mutex must be held.
+ */
+static void logdb_sync_enqueue (logdb_sync_t* sync, logdb_sync_waiter_t* waiter)
+{
+	waiter->result = -1;
+	waiter->done = false;
+	waiter->next = sync->pending;
+	sync->pending = waiter;
+}
+
+/**
+ * Waits for the given queued waiter to complete, leading a batch whenever no sync is in progress.
+ *  The mutex must be held.
+ */
+static int logdb_sync_complete (logdb_sync_t* sync, logdb_sync_waiter_t* waiter)
+{
+	while (!waiter->done) {
+		if (sync->syncing) {
+			/* A sync is already in progress, but it might have started before our
+			    writes were issued. Wait for it to finish and then try to lead the next one. */
+			pthread_cond_wait (&sync->cond, &sync->mutex);
+			continue;
+		}
+
+		/* Become the leader for everyone queued so far (including ourselves) */
+		logdb_sync_lead (sync);
+	}
+	return waiter->result;
+}
+
+int logdb_sync_wait (logdb_sync_t* sync)
+{
+	logdb_sync_waiter_t waiter;
+	int err = pthread_mutex_lock (&sync->mutex);
+	if (err) {
+		LOG("logdb_sync_wait: pthread_mutex_lock: %s", strerror (err));
+		return -1;
+	}
+
+	logdb_sync_enqueue (sync, &waiter);
+	int result = logdb_sync_complete (sync, &waiter);
+	pthread_mutex_unlock (&sync->mutex);
+	return result;
+}
+
+void logdb_sync_begin (logdb_sync_t* sync, logdb_sync_waiter_t* waiter)
+{
+	pthread_mutex_lock (&sync->mutex);
+	logdb_sync_enqueue (sync, waiter);
+	if (!sync->started) {
+		/* If we can't start the background leader, `logdb_sync_end` leads the sync itself */
+		int err = pthread_create (&sync->thread, NULL, &logdb_sync_main, sync);
+		if (err)
+			LOG("logdb_sync_begin: pthread_create: %s", strerror (err));
+		else
+			sync->started = true;
+	}
+	pthread_cond_broadcast (&sync->cond);
+	pthread_mutex_unlock (&sync->mutex);
+}
+
+int logdb_sync_end (logdb_sync_t* sync, logdb_sync_waiter_t* waiter)
+{
+	pthread_mutex_lock (&sync->mutex);
+	int result = logdb_sync_complete (sync, waiter);
+	pthread_mutex_unlock (&sync->mutex);
+	return result;
+}
+
+int logdb_sync_range (logdb_sync_t* sync, off_t offset, off_t len)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+	/* Start writeback of our own range so it is already in flight when the group sync runs.
+	    `sync_file_range` alone is not enough, even below what an earlier sync covered: it never
+	    writes back metadata, and the blocks of this range may have been allocated since then
+	    (by another writer, another process, or through preallocation). */
+	if ((sync_file_range (sync->fd, offset, len, SYNC_FILE_RANGE_WRITE) != 0) && (errno != ENOSYS) && (errno != EINVAL)) {
+		ELOG("logdb_sync_range: sync_file_range");
+		return -1;
+	}
+#else
+	(void)offset;
+	(void)len;
+#endif
+	return logdb_sync_wait (sync);
+}
+
+void logdb_sync_destroy (logdb_sync_t* sync)
+{
+	if (sync->started) {
+		pthread_mutex_lock (&sync->mutex);
+		sync->stopping = true;
+		pthread_cond_broadcast (&sync->cond);
+		pthread_mutex_unlock (&sync->mutex);
+		pthread_join (sync->thread, NULL);
+	}
+	pthread_cond_destroy (&sync->cond);
+	pthread_mutex_destroy (&sync->mutex);
+}
+
+static void* logdb_flusher_main (void* arg)
+{
+	logdb_flusher_t* flusher = (logdb_flusher_t*)arg;
+	struct timeval now;
+	struct timespec deadline;
+
+	pthread_mutex_lock (&flusher->mutex);
+	while (1) {
+		bool timedout = false;
+		if (flusher->running && !(flusher->bytes && (flusher->unflushed >= flusher->bytes))) {
+			if (flusher->millis) {
+				gettimeofday (&now, NULL);
+				deadline.tv_sec = now.tv_sec + (flusher->millis / 1000);
+				deadline.tv_nsec = (now.tv_usec * 1000L) + ((flusher->millis % 1000) * 1000000L);
+				if (deadline.tv_nsec >= 1000000000L) {
+					deadline.tv_sec++;
+					deadline.tv_nsec -= 1000000000L;
+				}
+				timedout = (pthread_cond_timedwait (&flusher->cond, &flusher->mutex, &deadline) == ETIMEDOUT);
+			} else {
+				pthread_cond_wait (&flusher->cond, &flusher->mutex);
+			}
+		}
+
+		/* Flush if our timer expired, we hit the byte threshold, or we are stopping */
+		bool stopping = !flusher->running;
+		bool full = flusher->bytes && (flusher->unflushed >= flusher->bytes);
+		if (flusher->unflushed && (timedout || full || stopping)) {
+			flusher->unflushed = 0;
+			pthread_mutex_unlock (&flusher->mutex);
+
+			/* As in a regular commit, sync the data and the log at the same time */
+			logdb_sync_waiter_t waiter;
+			logdb_sync_begin (flusher->log_sync, &waiter);
+			(void)logdb_sync_wait (flusher->data_sync);
+			(void)logdb_sync_end (flusher->log_sync, &waiter);
+
+			pthread_mutex_lock (&flusher->mutex);
+		}
+		if (stopping)
+			break;
+	}
+	pthread_mutex_unlock (&flusher->mutex);
+	return NULL;
+}
+
+int logdb_flusher_start (logdb_flusher_t* flusher, logdb_sync_t* data_sync, logdb_sync_t* log_sync)
+{
+	int err = pthread_mutex_init (&flusher->mutex, NULL);
+	if (err) {
+		LOG("logdb_flusher_start: pthread_mutex_init: %s", strerror (err));
+		return -1;
+	}
+	err = pthread_cond_init (&flusher->cond, NULL);
+	if (err) {
+		LOG("logdb_flusher_start: pthread_cond_init: %s", strerror (err));
+		pthread_mutex_destroy (&flusher->mutex);
+		return -1;
+	}
+
+	flusher->data_sync = data_sync;
+	flusher->log_sync = log_sync;
+	flusher->millis = LOGDB_FLUSH_DEFAULT_MILLIS;
+	flusher->bytes = LOGDB_FLUSH_DEFAULT_BYTES;
+	flusher->unflushed = 0;
+	flusher->running = true;
+
+	err = pthread_create (&flusher->thread, NULL, &logdb_flusher_main, flusher);
+	if (err) {
+		LOG("logdb_flusher_start: pthread_create: %s", strerror (err));
+		pthread_cond_destroy (&flusher->cond);
+		pthread_mutex_destroy (&flusher->mutex);
+		return -1;
+	}
+	return 0;
+}
+
+void logdb_flusher_configure (logdb_flusher_t* flusher, unsigned int millis, logdb_size_t bytes)
+{
+	pthread_mutex_lock (&flusher->mutex);
+	flusher->millis = millis;
+	flusher->bytes = bytes;
+	pthread_cond_signal (&flusher->cond);
+	pthread_mutex_unlock (&flusher->mutex);
+}
+
+void logdb_flusher_notify (logdb_flusher_t* flusher, logdb_size_t bytes)
+{
+	pthread_mutex_lock (&flusher->mutex);
+	flusher->unflushed += bytes;
+	if (flusher->bytes && (flusher->unflushed >= flusher->bytes))
+		pthread_cond_signal (&flusher->cond);
+	pthread_mutex_unlock (&flusher->mutex);
+}
+
+void logdb_flusher_stop (logdb_flusher_t* flusher)
+{
+	pthread_mutex_lock (&flusher->mutex);
+	flusher->running = false;
+	pthread_cond_signal (&flusher->cond);
+	pthread_mutex_unlock (&flusher->mutex);
+
+	pthread_join (flusher->thread, NULL);
+	pthread_cond_destroy (&flusher->cond);
+	pthread_mutex_destroy (&flusher->mutex);
+}
@@ -0,0 +1,135 @@
+#ifndef LOGDB_SYNC_H
+#define LOGDB_SYNC_H
+
+#include "logdb_internal.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+/**
+ * The default interval for the background flusher (see `logdb_set_flush_interval`).
+ */
+#define LOGDB_FLUSH_DEFAULT_MILLIS 100
+
+/**
+ * The default number of committed bytes that triggers the background flusher (see `logdb_set_flush_interval`).
+ */
+#define LOGDB_FLUSH_DEFAULT_BYTES (1024 * 1024)
+
+/**
+ * Internal struct representing a thread waiting for its writes to be synced.
+ *  These live on the waiting thread's stack between `logdb_sync_begin` and `logdb_sync_end`.
+ */
+typedef struct logdb_sync_waiter_t {
+	struct logdb_sync_waiter_t* next; /**< next waiter in the same batch, or null */
+	int result; /**< result of the sync that covered this waiter */
+	bool done; /**< set once a sync covering this waiter has completed */
+} logdb_sync_waiter_t;
+
+/**
+ * Internal struct that coalesces concurrent syncs of a file descriptor (group commit).
+ *
+ * Every thread that needs its writes to be durable queues itself as a waiter. If no sync is
+ *  in progress, that thread becomes the leader: it takes all queued waiters as a batch, issues
+ *  a single `fsync` for all of them, and then wakes them up. Threads that arrive while a sync
+ *  is in progress queue up for the next batch, since that sync may have started before their
+ *  writes were issued.
+ *
+ * A thread that needs to sync two files at once queues itself on one of them with
+ *  `logdb_sync_begin`, which hands the batch to a background thread if nobody else leads it,
+ *  and then waits on the other one. Both syncs are then in flight at the same time.
+ */
+typedef struct {
+	int fd; /**< the file descriptor to sync */
+	bool datasync; /**< use `fdatasync` rather than `fsync` */
+	pthread_t thread; /**< background leader, if `started` */
+	pthread_mutex_t mutex; /**< protects the fields below */
+	pthread_cond_t cond; /**< signaled when a batch completes, a waiter is queued, or on stop */
+	logdb_sync_waiter_t* pending; /**< waiters queued for the next batch, or null */
+	bool syncing; /**< true while a leader is syncing a batch */
+	bool started; /**< whether the background leader is running */
+	bool stopping; /**< asks the background leader to exit */
+} logdb_sync_t;
+
+/**
+ * Internal struct for the background thread that syncs a connection opened
+ *  with `LOGDB_OPEN_SYNC_PERIODIC`.
+ */
+typedef struct {
+	logdb_sync_t* data_sync; /**< sync group for the database file */
+	logdb_sync_t* log_sync; /**< sync group for the log file */
+	pthread_t thread;
+	pthread_mutex_t mutex; /**< protects the fields below */
+	pthread_cond_t cond; /**< signaled when settings change, the threshold is hit, or on stop */
+	unsigned int millis; /**< flush interval, or zero */
+	logdb_size_t bytes; /**< flush threshold, or zero */
+	logdb_size_t unflushed; /**< bytes committed since the last flush */
+	bool running;
+} logdb_flusher_t;
+
+/**
+ * Initializes the given sync group for the given file descriptor.
+ * \param sync The sync group to initialize.
+ * \param fd The file descriptor to sync.
+ * \param datasync Whether to use `fdatasync` rather than `fsync`, if available.
+ * \returns Zero (0) on success.
+ */
+int logdb_sync_init (logdb_sync_t* sync, int fd, bool datasync);
+
+/**
+ * Blocks until all writes issued to the sync group's file descriptor by the calling
+ *  thread before this call are durable.
+ * \returns Zero (0) on success.
+ */
+int logdb_sync_wait (logdb_sync_t* sync);
+
+/**
+ * Queues the calling thread for the next sync of the given sync group, without waiting for it.
+ *  The sync is led by the group's background thread, unless another thread gets to it first.
+ *  Every call must be matched by a call to `logdb_sync_end` with the same waiter.
+ * \param waiter Holds the caller's place in the queue until `logdb_sync_end`.
+ */
+void logdb_sync_begin (logdb_sync_t* sync, logdb_sync_waiter_t* waiter);
+
+/**
+ * Blocks until the sync that the given waiter was queued for by `logdb_sync_begin` has completed.
+ * \returns Zero (0) on success.
+ */
+int logdb_sync_end (logdb_sync_t* sync, logdb_sync_waiter_t* waiter);
+
+/**
+ * Like `logdb_sync_wait`, but first starts writeback of the given range of the sync group's
+ *  file descriptor, so that the data written by this caller is already in flight when the
+ *  group sync runs.
+ * \returns Zero (0) on success.
+ */
+int logdb_sync_range (logdb_sync_t* sync, off_t offset, off_t len);
+
+/**
+ * Stops the background leader of the given sync group, if it was started, and frees
+ *  the resources used by the group. There must be no waiters.
+ */
+void logdb_sync_destroy (logdb_sync_t* sync);
+
+/**
+ * Starts a background thread that periodically syncs the given sync groups (data first, then log).
+ * \returns Zero (0) on success.
+ */
+int logdb_flusher_start (logdb_flusher_t* flusher, logdb_sync_t* data_sync, logdb_sync_t* log_sync);
+
+/**
+ * Changes the interval and threshold of the given flusher. See `logdb_set_flush_interval`.
+ */
+void logdb_flusher_configure (logdb_flusher_t* flusher, unsigned int millis, logdb_size_t bytes);
+
+/**
+ * Notifies the flusher that the given number of bytes were committed.
+ */
+void logdb_flusher_notify (logdb_flusher_t* flusher, logdb_size_t bytes);
+
+/**
+ * Stops the flusher's background thread after a final flush, and frees its resources.
+ */
+void logdb_flusher_stop (logdb_flusher_t* flusher);
+
+#endif /* LOGDB_SYNC_H */
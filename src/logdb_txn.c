@@ -2,12 +2,81 @@
 #include "logdb_txn.h"
 #include "logdb_data.h"
 #include "logdb_lease.h"
+#include "logdb_io.h"
+#include "logdb_crc.h"
 
 #include <stdlib.h>
 #include <pthread.h>
 #include <string.h>
 #include <unistd.h>
 
+/* Thread-local staging buffer for puts outside of a transaction (see `logdb_txn_staging`) */
+static pthread_once_t logdb_txn_staging_once = PTHREAD_ONCE_INIT;
+static pthread_key_t logdb_txn_staging_key;
+static bool logdb_txn_staging_ok;
+
+typedef struct {
+	size_t size; /**< number of bytes in `data` */
+	char data[];
+} logdb_txn_staging_t;
+
+static void logdb_txn_staging_init (void)
+{
+	int err = pthread_key_create (&logdb_txn_staging_key, &free);
+	if (err)
+		LOG("logdb_txn_staging_init: pthread_key_create: %s", strerror (err));
+	logdb_txn_staging_ok = (err == 0);
+}
+
+/**
+ * Returns the calling thread's staging buffer, which is reused by every put outside of a transaction
+ *  on the thread so that serializing a record doesn't need an allocation. It grows as needed, but puts
+ *  only use it for records that fit in a section, so it never gets much bigger than one.
+ * \returns A buffer of at least `size` bytes, or NULL on failure.
+ */
+static char* logdb_txn_staging (size_t size)
+{
+	if ((pthread_once (&logdb_txn_staging_once, &logdb_txn_staging_init) != 0) || !logdb_txn_staging_ok)
+		return NULL;
+
+	logdb_txn_staging_t* staging = (logdb_txn_staging_t*)pthread_getspecific (logdb_txn_staging_key);
+	if (staging && (staging->size >= size))
+		return staging->data;
+
+	size_t newsize = staging? staging->size : 4096;
+	while (newsize < size)
+		newsize *= 2;
+	logdb_txn_staging_t* newstaging = realloc (staging, sizeof (logdb_txn_staging_t) + newsize);
+	if (!newstaging) {
+		ELOG("logdb_txn_staging: realloc");
+		return NULL;
+	}
+	newstaging->size = newsize;
+	if (pthread_setspecific (logdb_txn_staging_key, newstaging) != 0) {
+		LOG("logdb_txn_staging: pthread_setspecific failed");
+		free (newstaging);
+		return NULL;
+	}
+	return newstaging->data;
+}
+
+/**
+ * Copies the data in the given buffer chain to `dest`, without flattening it like `logdb_buffer_data` does.
+ * \returns A pointer past the last byte copied.
+ */
+static char* logdb_txn_copy_buffer (const logdb_buffer_t* buf, char* dest)
+{
+	for (; buf; buf = buf->next) {
+		if (buf->orig) {
+			dest = logdb_txn_copy_buffer (buf->orig, dest);
+		} else {
+			(void)memcpy (dest, buf->data, buf->len);
+			dest += buf->len;
+		}
+	}
+	return dest;
+}
+
 static logdb_txn_t* logdb_txn_current (logdb_connection_t* conn)
 {
 	return (logdb_txn_t*)pthread_getspecific (conn->current_txn_key);
@@ -18,21 +87,150 @@ static int logdb_txn_set_current (logdb_connection_t* conn, logdb_txn_t* txn)
 	return pthread_setspecific (conn->current_txn_key, txn);
 }
 
-static int logdb_txn_write_buf (logdb_lease_t* lease, logdb_buffer_t* buf)
+/**
+ * Gathers a frame and the given buffer chain into iovecs, so they can be written with a single `pwritev`,
+ *  and fills in the frame's length and checksum for a frame written at the given lease's position.
+ * \param stackiov An array of `LOGDB_TXN_STACK_IOVECS` iovecs that is used if everything fits in it.
+ * \param iovcnt Set to the number of iovecs.
+ * \returns Either `stackiov` or an array that must be freed, or NULL on failure.
+ */
+static struct iovec* logdb_txn_gather (const logdb_lease_t* lease, logdb_buffer_t* buf, logdb_data_frame_t* frame, struct iovec* stackiov, int* iovcnt)
 {
-	do {
-		if (buf->orig) {
-			if (logdb_txn_write_buf (lease, buf->orig) != 0)
-				return -1;
-		} else {
-			if (logdb_lease_write (lease, buf->data, buf->len) != 0)
-				return -1;
+	struct iovec* iov = stackiov;
+	*iovcnt = 1 + logdb_buffer_iovec (buf, iov + 1, LOGDB_TXN_STACK_IOVECS - 1);
+	if (*iovcnt > LOGDB_TXN_STACK_IOVECS) {
+		iov = malloc (*iovcnt * sizeof (struct iovec));
+		if (!iov) {
+			ELOG("logdb_txn_gather: malloc");
+			return NULL;
+		}
+		(void)logdb_buffer_iovec (buf, iov + 1, *iovcnt - 1);
+	}
+
+	frame->len = logdb_buffer_length (buf);
+	frame->crc = logdb_crc32c_frame (lease->index, lease->offset, frame->len);
+	for (int i = 1; i < *iovcnt; i++)
+		frame->crc = logdb_crc32c (frame->crc, iov[i].iov_base, iov[i].iov_len);
+	iov[0].iov_base = frame;
+	iov[0].iov_len = sizeof (logdb_data_frame_t);
+	return iov;
+}
+
+/**
+ * Makes the data written to the given lease since `start` and its log entry durable. The data and the
+ *  log are synced at the same time, and concurrent committers share a single `fsync` of each file
+ *  (group commit). If we were asked to, writeback of our own range of the data is started first.
+ * \param start The offset in the database file at which the data was written. The lease's offset
+ *  must already be past the data.
+ * \returns Zero (0) on success. On failure, the lease must be aborted.
+ */
+static int logdb_txn_sync (logdb_connection_t* conn, logdb_lease_t* lease, off_t start)
+{
+	logdb_sync_waiter_t logwait;
+	logdb_sync_begin (&conn->log_sync, &logwait);
+	off_t len = (logdb_connection_offset (conn, lease->index) + lease->offset) - start;
+	int result = ((conn->flags & LOGDB_OPEN_SYNC_RANGE) == LOGDB_OPEN_SYNC_RANGE)?
+		logdb_sync_range (&conn->data_sync, start, len) : logdb_sync_wait (&conn->data_sync);
+
+	/* I don't think there's really much we can do if the log sync fails? */
+	(void)logdb_sync_end (&conn->log_sync, &logwait);
+	if (result != 0) {
+		/* Take back the log entry, so the data doesn't show up after we report failure. The entry
+		    may already be durable, so make sure taking it back is too. A span is taken back entirely,
+		    head first so readers never see it without its continuations, and its sections go back to
+		    the free-space index when the lease is aborted. */
+		LOG("logdb_txn_sync: failed to sync data");
+		logdb_log_entry_t entry;
+		entry.len = start - logdb_connection_offset (conn, lease->index);
+		int taken = 0;
+		for (logdb_size_t i = 0; (i < lease->count) && (taken == 0); i++) {
+			taken = logdb_log_write_entry (conn->log, &entry, lease->index + i);
+			entry.len = 0;
 		}
-		buf = buf->next;
-	} while (buf);
+		if (taken == 0)
+			(void)logdb_sync_wait (&conn->log_sync);
+		return -1;
+	}
 	return 0;
 }
 
+/**
+ * Writes the given data to the given lease and updates the log, and then syncs both if needed.
+ *  Since each frame is checksummed, the data does not have to be durable before the log is updated;
+ *  if we crash before both are, recovery discards the frame (see `logdb_log_recover`). It does have to
+ *  be written first, though, since readers trust the log entry to cover only data that is there.
+ * \returns Zero (0) on success. On failure, the lease must be aborted.
+ */
+static int logdb_txn_write (logdb_connection_t* conn, logdb_lease_t* lease, logdb_buffer_t* buf, bool durable)
+{
+	struct iovec stackiov[LOGDB_TXN_STACK_IOVECS];
+	logdb_data_frame_t frame;
+	int iovcnt;
+	struct iovec* iov = logdb_txn_gather (lease, buf, &frame, stackiov, &iovcnt);
+	if (!iov)
+		return -1;
+
+	/* Write the data */
+	off_t start = logdb_connection_offset (conn, lease->index) + lease->offset;
+	int result = (logdb_lease_writev (lease, iov, iovcnt) == 0)? 0 : -1;
+	if (iov != stackiov)
+		free (iov);
+	if (result != 0)
+		return -1;
+
+	/* Update the log */
+	logdb_log_entry_t entry;
+	entry.len = lease->offset;
+	result = (lease->count > 1)?
+		logdb_log_write_span (conn->log, lease->index, lease->count, lease->offset) :
+		logdb_log_write_entry (conn->log, &entry, lease->index);
+	if (result != 0) {
+		/* FIXME: There *might* be a slim chance we've corrupted the log here. */
+		return -1;
+	}
+
+	return durable? logdb_txn_sync (conn, lease, start) : 0;
+}
+
+/**
+ * Like `logdb_txn_write`, but submits the data write and the log write at once, as a chain in which the
+ *  log write only starts once the data write has completed (see `logdb_io_run_chains`). The syncs still
+ *  go through the connection's sync groups, so they are shared with other committers. This is used for
+ *  connections opened with `LOGDB_OPEN_IO_URING`, and only for leases of one section.
+ * \returns Zero (0) on success. On failure, the lease must be aborted.
+ */
+static int logdb_txn_write_chain (logdb_connection_t* conn, logdb_lease_t* lease, logdb_buffer_t* buf, bool durable)
+{
+	struct iovec stackiov[LOGDB_TXN_STACK_IOVECS];
+	logdb_data_frame_t frame;
+	int iovcnt;
+	struct iovec* iov = logdb_txn_gather (lease, buf, &frame, stackiov, &iovcnt);
+	if (!iov)
+		return -1;
+
+	logdb_size_t len = sizeof (logdb_data_frame_t) + frame.len;
+	logdb_log_entry_t entry;
+	char rawentry[LOGDB_LOG_ENTRY_MAX_SIZE];
+	entry.len = lease->offset + len;
+	struct iovec entryiov = { rawentry, logdb_log_encode_entry (conn->log, &entry, rawentry) };
+
+	off_t start = logdb_connection_offset (conn, lease->index) + lease->offset;
+	logdb_io_op_t ops[2] = {
+		{ LOGDB_IO_OP_WRITEV, conn->fd, iov, iovcnt, start },
+		{ LOGDB_IO_OP_WRITEV, conn->log->pfd, &entryiov, 1, logdb_log_offset (conn->log, lease->index) }
+	};
+	int lens[1] = { 2 };
+	int done[1];
+	(void)logdb_io_run_chains (ops, lens, 1, done);
+	if (iov != stackiov)
+		free (iov);
+	if (done[0] < 2)
+		return -1;
+
+	(void)logdb_lease_seek (lease, len);
+	return durable? logdb_txn_sync (conn, lease, start) : 0;
+}
+
 logdb_txn_t* logdb_txn_begin_implicit (logdb_connection_t* conn)
 {
 	logdb_txn_t* txn = calloc (1, sizeof (logdb_txn_t));
@@ -41,74 +239,160 @@ logdb_txn_t* logdb_txn_begin_implicit (logdb_connection_t* conn)
 		return NULL;
 	}
 
+	/* Nested transactions append to the arena of the outermost one */
 	txn->outer = logdb_txn_current (conn);
+	txn->arena = txn->outer? txn->outer->arena : &txn->own_arena;
+	txn->savepoint = txn->arena->len;
 	return txn;
 }
 
 /**
- * Closes the given transaction and frees its resources.
- * \param conn The associated database connection. May be NULL, in which case all outer transactions are also closed.
+ * Makes room for `len` more bytes at the end of the given transaction's arena. The caller
+ *  writes the data at the returned pointer and then adds `len` to the arena's length.
+ * \returns A pointer to the end of the arena, or NULL on failure.
  */
-static void logdb_txn_close (logdb_connection_t* conn, logdb_txn_t* txn)
+static char* logdb_txn_reserve (logdb_txn_t* txn, size_t len)
 {
-	if (conn) {
-		logdb_txn_set_current (conn, txn->outer);
-	} else if (txn->outer) {
-		logdb_txn_close (NULL, txn->outer);
+	logdb_txn_arena_t* arena = txn->arena;
+	if ((((logdb_size_t)~0) - arena->len) < len) {
+		/* The whole transaction has to fit in a frame */
+		LOG("logdb_txn_reserve: overflow");
+		return NULL;
 	}
-	if (txn->buf)
-		logdb_buffer_free (txn->buf);
-	free (txn);
+	if ((arena->size - arena->len) < len) {
+		size_t newsize = arena->size? arena->size : LOGDB_TXN_MIN_ARENA_SIZE;
+		while (newsize < (arena->len + len))
+			newsize *= 2;
+		char* newdata = realloc (arena->data, newsize);
+		if (!newdata) {
+			ELOG("logdb_txn_reserve: realloc");
+			return NULL;
+		}
+		arena->data = newdata;
+		arena->size = newsize;
+	}
+	return arena->data + arena->len;
 }
 
-static int logdb_txn_commit (logdb_connection_t* conn, logdb_txn_t* txn)
+int logdb_txn_merge (logdb_txn_t* dst, logdb_txn_t* src)
 {
-	/* Determine how much data we have to write */
-	size_t len = logdb_buffer_length (txn->buf);
+	size_t len = src->arena->len;
 	if (len == 0)
-		goto closereturn;
+		return 0;
 
-	/* If this is not the outer transaction, then merge our data
-	    into the outer transaction */
-	if (txn->outer) {
-		if (txn->buf)
-			txn->outer->buf = logdb_buffer_append (txn->outer->buf, txn->buf);
-		goto closereturn;
+	/* If we don't have any data yet, just take theirs */
+	if (dst->arena->len == 0) {
+		logdb_txn_arena_t tmp = *(dst->arena);
+		*(dst->arena) = *(src->arena);
+		*(src->arena) = tmp;
+		return 0;
 	}
 
-	/* Acquire a lease to write this data */
-	logdb_lease_t lease;
-	if (logdb_lease_acquire_write (&lease, conn, len) != 0)
+	char* ptr = logdb_txn_reserve (dst, len);
+	if (!ptr)
 		return -1;
+	(void)memcpy (ptr, src->arena->data, len);
+	dst->arena->len += len;
+	return 0;
+}
 
-	/* Write the data */
-	if (logdb_txn_write_buf (&lease, txn->buf) != 0) {
-		logdb_lease_release (&lease);
-		return -1;
+/**
+ * Closes the given transaction and frees its resources. Its data is left in the arena for
+ *  the outer transaction, so to roll it back, first truncate the arena to its savepoint.
+ * \param conn The associated database connection. May be NULL, in which case all outer transactions are also closed.
+ */
+static void logdb_txn_close (logdb_connection_t* conn, logdb_txn_t* txn)
+{
+	if (conn) {
+		logdb_txn_set_current (conn, txn->outer);
+	} else if (txn->outer) {
+		logdb_txn_close (NULL, txn->outer);
 	}
+	logdb_txn_free (txn);
+}
+
+void logdb_txn_free (logdb_txn_t* txn)
+{
+	free (txn->own_arena.data);
+	free (txn);
+}
 
-	bool durable = (conn->flags & LOGDB_OPEN_NOSYNC) != LOGDB_OPEN_NOSYNC;
-	if (durable && (fsync (conn->fd) == -1)) {
-		ELOG("logdb_txn_commit: fsync 1");
-		logdb_lease_release (&lease);
+/**
+ * Writes the given buffer chain, which holds `len` bytes of serialized records, to the database
+ *  as a single frame, leasing space for it and updating the log.
+ * \returns Zero (0) on success.
+ */
+static int logdb_txn_write_buffer (logdb_connection_t* conn, logdb_buffer_t* buf, size_t len)
+{
+	/* Acquire a lease to write this data, preceded by its frame */
+	logdb_lease_t local;
+	logdb_lease_t* lease = &local;
+	size_t framelen = sizeof (logdb_data_frame_t) + len;
+	if (((conn->flags & LOGDB_OPEN_STICKY_LEASES) == LOGDB_OPEN_STICKY_LEASES) && (framelen <= conn->section_size)) {
+		if (logdb_lease_acquire_sticky (&lease, conn, framelen) != 0)
+			return -1;
+	} else if (logdb_lease_acquire_write (lease, conn, framelen) != 0) {
 		return -1;
 	}
 
-	/* Update the log */
-	logdb_log_entry_t entry;
-	entry.len = lease.offset;
-	if (logdb_log_write_entry (conn->log, &entry, lease.index) != 0) {
-		/* FIXME: There *might* be a slim chance we've corrupted the log here. */
-		logdb_lease_release (&lease);
+	/* Write the data and update the log */
+	bool durable = LOGDB_CONNECTION_SYNC_ON_COMMIT(conn);
+	bool chain = ((conn->flags & LOGDB_OPEN_IO_URING) == LOGDB_OPEN_IO_URING)
+		&& (conn->direct_fd == -1) && (lease->count == 1) && logdb_io_chain_supported ();
+	int result = chain?
+		logdb_txn_write_chain (conn, lease, buf, durable) :
+		logdb_txn_write (conn, lease, buf, durable);
+	if (result != 0) {
+		logdb_lease_abort (lease);
 		return -1;
 	}
 
-	/* I don't think there's really much we can do if this fails? */
-	if (durable)
-		(void)fsync (conn->log->fd);
+	if (!durable && LOGDB_CONNECTION_HAS_FLUSHER(conn))
+		logdb_flusher_notify (&conn->flusher, framelen);
+
+	/* Release the lease, and let anyone following the database know there's more to read */
+	logdb_lease_release (lease);
+	logdb_shm_notify (conn->log->shm);
+	return 0;
+}
+
+/**
+ * Initializes a buffer that lives on the stack for the duration of a write, so that
+ *  writing doesn't need to allocate one.
+ */
+static void logdb_txn_init_buffer (logdb_buffer_t* buf, void* data, logdb_size_t len, logdb_buffer_t* orig, logdb_buffer_t* next)
+{
+	buf->data = data;
+	buf->len = len;
+	buf->disposer = NULL;
+	buf->orig = orig;
+	buf->next = next;
+	buf->owner = NULL;
+	atomic_init (&buf->refcnt, 1);
+	atomic_init (&buf->flat, NULL);
+}
+
+/**
+ * Writes the given serialized records, without allocating a buffer or a transaction for them.
+ * \returns Zero (0) on success.
+ */
+static int logdb_txn_write_data (logdb_connection_t* conn, char* data, size_t len)
+{
+	logdb_buffer_t buf;
+	logdb_txn_init_buffer (&buf, data, len, NULL, NULL);
+	return logdb_txn_write_buffer (conn, &buf, len);
+}
+
+static int logdb_txn_commit (logdb_connection_t* conn, logdb_txn_t* txn)
+{
+	/* Determine how much data we have to write. If this is not the outer transaction,
+	    our data is already where the outer transaction will write it from. */
+	size_t len = txn->arena->len - txn->savepoint;
+	if ((len == 0) || txn->outer)
+		goto closereturn;
 
-	/* Release the lease */
-	logdb_lease_release (&lease);
+	if (logdb_txn_write_data (conn, txn->arena->data, len) != 0)
+		return -1;
 closereturn:
 	logdb_txn_close (conn, txn);
 	return 0;
@@ -144,25 +428,100 @@ int logdb_put LOGDB_VERIFY_CONNECTION(logdb_connection_t* conn, logdb_buffer* ke
 	logdb_data_header_t header;
 	header.keylen = logdb_buffer_length (key);
 	header.valuelen = logdb_buffer_length (value);
+	size_t len = sizeof (header) + (size_t)header.keylen + header.valuelen;
+
+	/* Inside of a transaction, just append the record to its arena */
+	logdb_txn_t* txn = logdb_txn_current (conn);
+	if (txn) {
+		char* ptr = logdb_txn_reserve (txn, len);
+		if (!ptr)
+			return -1;
+		(void)memcpy (ptr, &header, sizeof (header));
+		logdb_txn_copy_buffer (value, logdb_txn_copy_buffer (key, ptr + sizeof (header)));
+		txn->arena->len += len;
+		return 0;
+	}
+
+	/* Otherwise, records that fit in a section are serialized into our staging buffer
+	    and written directly, which is much cheaper than building a transaction for them */
+	if ((sizeof (logdb_data_frame_t) + len) <= conn->section_size) {
+		char* staging = logdb_txn_staging (len);
+		if (staging) {
+			(void)memcpy (staging, &header, sizeof (header));
+			logdb_txn_copy_buffer (value, logdb_txn_copy_buffer (key, staging + sizeof (header)));
+			return logdb_txn_write_data (conn, staging, len);
+		}
+	}
 
-	/* Create buffer for record header */
-	logdb_buffer* headerbuf = logdb_buffer_new_copy (&header, sizeof (header));
-	if (!headerbuf) {
-		LOG("logdb_put: logdb_buffer_new_copy failed");
+	/* Larger records are written straight from the passed buffers, rather than copying them */
+	if (len > (logdb_size_t)~0) {
+		LOG("logdb_put: overflow");
 		return -1;
 	}
+	logdb_buffer_t bufs[3];
+	logdb_txn_init_buffer (&bufs[2], NULL, 0, (logdb_buffer_t*)value, NULL);
+	logdb_txn_init_buffer (&bufs[1], NULL, 0, (logdb_buffer_t*)key, &bufs[2]);
+	logdb_txn_init_buffer (&bufs[0], &header, sizeof (header), NULL, &bufs[1]);
+	return logdb_txn_write_buffer (conn, &bufs[0], len);
+}}
 
-	/* Create an implicit transaction for this put */
-	logdb_txn_t* txn = logdb_txn_begin_implicit (conn);
-	if (!txn) {
-		LOG("logdb_put: logdb_txn_begin_implicit failed");
-		logdb_buffer_free (headerbuf);
+int logdb_put_batch LOGDB_VERIFY_CONNECTION(logdb_connection_t* conn, const void** keys, const logdb_size_t* keylens, const void** values, const logdb_size_t* valuelens, size_t count)
+{
+	DBGIF(!keys || !keylens || !values || !valuelens) {
+		LOG("logdb_put_batch: keys, keylens, values or valuelens was null");
+		return -1;
+	}
+	if (count == 0)
+		return 0;
+
+	/* Determine how much space all the records need */
+	logdb_size_t len = 0;
+	for (size_t i = 0; i < count; i++) {
+		logdb_size_t reclen = sizeof (logdb_data_header_t) + keylens[i];
+		if ((reclen < keylens[i]) || ((((logdb_size_t)~0) - reclen) < valuelens[i])
+		 || ((((logdb_size_t)~0) - len) < (reclen + valuelens[i]))) {
+			LOG("logdb_put_batch: overflow");
+			return -1;
+		}
+		len += reclen + valuelens[i];
+	}
+
+	/* Serialize all the records into one buffer: the current transaction's arena, if there is one,
+	    otherwise our staging buffer if they fit in a section, as in `logdb_put` */
+	logdb_txn_t* txn = logdb_txn_current (conn);
+	bool staged = !txn && ((sizeof (logdb_data_frame_t) + len) <= conn->section_size);
+	char* data = txn? logdb_txn_reserve (txn, len) : (staged? logdb_txn_staging (len) : NULL);
+	if (txn && !data)
+		return -1;
+	if (!data) {
+		staged = false;
+		data = malloc (len);
+	}
+	if (!data) {
+		ELOG("logdb_put_batch: malloc");
 		return -1;
 	}
+	char* ptr = data;
+	for (size_t i = 0; i < count; i++) {
+		logdb_data_header_t header;
+		header.keylen = keylens[i];
+		header.valuelen = valuelens[i];
+		(void)memcpy (ptr, &header, sizeof (header));
+		ptr += sizeof (header);
+		(void)memcpy (ptr, keys[i], keylens[i]);
+		ptr += keylens[i];
+		(void)memcpy (ptr, values[i], valuelens[i]);
+		ptr += valuelens[i];
+	}
 
-	/* Commit the write */
-	txn->buf = logdb_buffer_append (logdb_buffer_append (headerbuf, key), value);
-	return logdb_txn_commit_implicit (conn, txn);
+	if (txn) {
+		txn->arena->len += len;
+		return 0;
+	}
+	int result = logdb_txn_write_data (conn, data, len);
+	if (!staged)
+		free (data);
+	return result;
 }}
 
 int logdb_commit LOGDB_VERIFY_CONNECTION(logdb_connection_t* conn)
@@ -174,12 +533,39 @@ int logdb_commit LOGDB_VERIFY_CONNECTION(logdb_connection_t* conn)
 	return logdb_txn_commit (conn, txn);
 }}
 
+int logdb_commit_async LOGDB_VERIFY_CONNECTION(logdb_connection_t* conn, logdb_commit_callback callback, void* context)
+{
+	logdb_txn_t* txn = logdb_txn_current (conn);
+	if (!txn)
+		return -1;
+
+	/* Nested transactions are merged into their outer transaction right away */
+	if (txn->outer) {
+		int result = logdb_txn_commit (conn, txn);
+		if ((result == 0) && callback)
+			callback (conn, result, context);
+		return result;
+	}
+
+	/* Hand the transaction off to the writer. Once it is queued, it belongs to the writer. */
+	txn->callback = callback;
+	txn->context = context;
+	if (logdb_txn_set_current (conn, NULL) != 0)
+		return -1;
+	if (logdb_writer_enqueue (&conn->writer, txn) != 0) {
+		(void)logdb_txn_set_current (conn, txn);
+		return -1;
+	}
+	return 0;
+}}
+
 int logdb_rollback LOGDB_VERIFY_CONNECTION(logdb_connection_t* conn)
 {
 	logdb_txn_t* txn = logdb_txn_current (conn);
 	if (!txn)
 		return -1;
 
+	txn->arena->len = txn->savepoint;
 	logdb_txn_close (conn, txn);
 	return 0;
 }}
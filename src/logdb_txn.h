@@ -5,12 +5,42 @@
 #include "logdb_connection.h"
 #include "logdb_buffer.h"
 
+/**
+ * The number of buffer fragments a commit can gather on the stack before
+ *  it needs to allocate an iovec array.
+ */
+#define LOGDB_TXN_STACK_IOVECS 64
+
+/**
+ * The initial size of a transaction's arena.
+ */
+#define LOGDB_TXN_MIN_ARENA_SIZE 4096 /* bytes */
+
+/**
+ * Internal structure that holds the serialized records of a thread's stack of transactions.
+ *  Each transaction appends to the end, remembering where it started (its savepoint), so committing
+ *  a nested transaction leaves its data in place for the outer one, and rolling it back truncates
+ *  the arena to its savepoint.
+ */
+typedef struct {
+	char* data;
+	size_t len; /**< number of bytes in use */
+	size_t size; /**< number of bytes allocated */
+} logdb_txn_arena_t;
+
 /**
  * Internal structure that represents a transaction
  */
 typedef struct logdb_txn_t {
 	struct logdb_txn_t* outer; /**< outer transaction for this thread, or null */
-	logdb_buffer_t* buf; /**< the data added by this transaction, or null */
+	logdb_txn_arena_t* arena; /**< the arena shared by this thread's transactions, which belongs to the outermost one */
+	size_t savepoint; /**< length of `arena` when this transaction began */
+	logdb_txn_arena_t own_arena; /**< only used by the outermost transaction */
+
+	/* Only used for transactions passed to `logdb_commit_async` */
+	struct logdb_txn_t* next; /**< next transaction in the writer's queue, or null */
+	logdb_commit_callback callback; /**< called when the commit completes, or null */
+	void* context; /**< passed to `callback` */
 } logdb_txn_t;
 
 /**
@@ -30,6 +60,19 @@ logdb_txn_t* logdb_txn_begin_implicit (logdb_connection_t* conn);
  */
 int logdb_txn_commit_implicit (logdb_connection_t* conn, logdb_txn_t* txn);
 
+/**
+ * Appends the data of the given outermost transaction, which is not on any thread, to another one.
+ *  If `dst` has no data yet, it takes over `src`'s arena instead of copying it.
+ * \returns Zero (0) on success.
+ */
+int logdb_txn_merge (logdb_txn_t* dst, logdb_txn_t* src);
+
+/**
+ * Frees the given transaction that has already been removed from its thread, without committing it.
+ *  Its outer transactions (if any) are not affected.
+ */
+void logdb_txn_free (logdb_txn_t* txn);
+
 /**
  * Rolls back all open transactions on the current thread.
  */
@@ -0,0 +1,237 @@
+#include "logdb_writer.h"
+#include "logdb_connection.h"
+#include "logdb_txn.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <stdatomic.h>
+
+/**
+ * Internal struct that represents the pending result of an asynchronous commit.
+ */
+typedef struct {
+	pthread_mutex_t mutex; /**< protects `done` and `result` */
+	pthread_cond_t cond; /**< signaled when `done` is set */
+	bool done;
+	int result;
+	volatile atomic_int refcnt; /**< one reference for the caller, and one for the pending callback */
+} logdb_future_t;
+
+/**
+ * Commits the given list of transactions, oldest first, combining as many of them as
+ *  possible into each write, and then calls their callbacks and frees them.
+ */
+static void logdb_writer_commit (logdb_connection_t* conn, logdb_txn_t* list)
+{
+	while (list) {
+		int result = -1;
+		logdb_txn_t* end = list->next;
+		logdb_txn_t* combined = logdb_txn_begin_implicit (conn);
+		if (combined) {
+			/* Take the data from as many transactions as will fit in one frame */
+			for (end = list; end; end = end->next) {
+				if (logdb_txn_merge (combined, end) != 0)
+					break;
+			}
+			result = logdb_txn_commit_implicit (conn, combined);
+		}
+
+		while (list != end) {
+			logdb_txn_t* next = list->next;
+			if (list->callback)
+				list->callback (conn, result, list->context);
+			logdb_txn_free (list);
+			list = next;
+		}
+	}
+}
+
+static void* logdb_writer_main (void* arg)
+{
+	logdb_connection_t* conn = (logdb_connection_t*)arg;
+	logdb_writer_t* writer = &conn->writer;
+
+	while (1) {
+		logdb_txn_t* list = atomic_exchange (&writer->queue, NULL);
+		if (!list) {
+			/* Nothing to do; go to sleep. We must check the queue again after setting
+			    `sleeping`, since a producer may have pushed before it saw the flag. */
+			pthread_mutex_lock (&writer->mutex);
+			atomic_store (&writer->sleeping, true);
+			while (writer->running && !atomic_load (&writer->queue))
+				pthread_cond_wait (&writer->cond, &writer->mutex);
+			atomic_store (&writer->sleeping, false);
+			bool stop = !writer->running && !atomic_load (&writer->queue);
+			pthread_mutex_unlock (&writer->mutex);
+			if (stop)
+				break;
+			continue;
+		}
+
+		/* The queue is a stack, so reverse it to commit in the order transactions were queued */
+		logdb_txn_t* ordered = NULL;
+		while (list) {
+			logdb_txn_t* next = list->next;
+			list->next = ordered;
+			ordered = list;
+			list = next;
+		}
+		logdb_writer_commit (conn, ordered);
+	}
+	return NULL;
+}
+
+int logdb_writer_init (logdb_writer_t* writer, void* connection)
+{
+	int err = pthread_mutex_init (&writer->mutex, NULL);
+	if (err) {
+		LOG("logdb_writer_init: pthread_mutex_init: %s", strerror (err));
+		return -1;
+	}
+	err = pthread_cond_init (&writer->cond, NULL);
+	if (err) {
+		LOG("logdb_writer_init: pthread_cond_init: %s", strerror (err));
+		pthread_mutex_destroy (&writer->mutex);
+		return -1;
+	}
+	atomic_init (&writer->queue, NULL);
+	atomic_init (&writer->sleeping, false);
+	atomic_init (&writer->started, false);
+	writer->running = true;
+	writer->connection = connection;
+	return 0;
+}
+
+int logdb_writer_enqueue (logdb_writer_t* writer, logdb_txn_t* txn)
+{
+	/* Start the thread the first time we need it */
+	if (!atomic_load (&writer->started)) {
+		pthread_mutex_lock (&writer->mutex);
+		if (!atomic_load (&writer->started)) {
+			int err = pthread_create (&writer->thread, NULL, &logdb_writer_main, writer->connection);
+			if (err) {
+				LOG("logdb_writer_enqueue: pthread_create: %s", strerror (err));
+				pthread_mutex_unlock (&writer->mutex);
+				return -1;
+			}
+			atomic_store (&writer->started, true);
+		}
+		pthread_mutex_unlock (&writer->mutex);
+	}
+
+	logdb_txn_t* head = atomic_load (&writer->queue);
+	do {
+		txn->next = head;
+	} while (!atomic_compare_exchange_weak (&writer->queue, &head, txn));
+
+	/* Only pay for the mutex if the writer might be waiting for us */
+	if (atomic_load (&writer->sleeping)) {
+		pthread_mutex_lock (&writer->mutex);
+		pthread_cond_signal (&writer->cond);
+		pthread_mutex_unlock (&writer->mutex);
+	}
+	return 0;
+}
+
+void logdb_writer_stop (logdb_writer_t* writer)
+{
+	if (atomic_load (&writer->started)) {
+		pthread_mutex_lock (&writer->mutex);
+		writer->running = false;
+		pthread_cond_signal (&writer->cond);
+		pthread_mutex_unlock (&writer->mutex);
+		pthread_join (writer->thread, NULL);
+	}
+	pthread_cond_destroy (&writer->cond);
+	pthread_mutex_destroy (&writer->mutex);
+}
+
+static void logdb_future_release (logdb_future_t* future)
+{
+	if (atomic_fetch_sub (&future->refcnt, 1) > 1)
+		return;
+	pthread_cond_destroy (&future->cond);
+	pthread_mutex_destroy (&future->mutex);
+	free (future);
+}
+
+static void logdb_future_complete (logdb_connection* connection, int result, void* context)
+{
+	(void)connection;
+	logdb_future_t* future = (logdb_future_t*)context;
+	pthread_mutex_lock (&future->mutex);
+	future->result = result;
+	future->done = true;
+	pthread_cond_broadcast (&future->cond);
+	pthread_mutex_unlock (&future->mutex);
+	logdb_future_release (future);
+}
+
+logdb_future* logdb_commit_future (logdb_connection* connection)
+{
+	logdb_future_t* future = malloc (sizeof (logdb_future_t));
+	if (!future) {
+		ELOG("logdb_commit_future: malloc");
+		return NULL;
+	}
+	if (pthread_mutex_init (&future->mutex, NULL) != 0) {
+		LOG("logdb_commit_future: pthread_mutex_init failed");
+		free (future);
+		return NULL;
+	}
+	if (pthread_cond_init (&future->cond, NULL) != 0) {
+		LOG("logdb_commit_future: pthread_cond_init failed");
+		pthread_mutex_destroy (&future->mutex);
+		free (future);
+		return NULL;
+	}
+	future->done = false;
+	future->result = -1;
+	atomic_init (&future->refcnt, 2);
+
+	if (logdb_commit_async (connection, &logdb_future_complete, future) != 0) {
+		/* The callback will never be called, so drop its reference too */
+		atomic_store (&future->refcnt, 1);
+		logdb_future_release (future);
+		return NULL;
+	}
+	return future;
+}
+
+int logdb_future_poll (logdb_future* fut)
+{
+	logdb_future_t* future = (logdb_future_t*)fut;
+	DBGIF(!future) {
+		LOG("logdb_future_poll: passed future was NULL");
+		return 0;
+	}
+	pthread_mutex_lock (&future->mutex);
+	bool done = future->done;
+	pthread_mutex_unlock (&future->mutex);
+	return done? 1 : 0;
+}
+
+int logdb_future_wait (logdb_future* fut)
+{
+	logdb_future_t* future = (logdb_future_t*)fut;
+	DBGIF(!future) {
+		LOG("logdb_future_wait: passed future was NULL");
+		return -1;
+	}
+	pthread_mutex_lock (&future->mutex);
+	while (!future->done)
+		pthread_cond_wait (&future->cond, &future->mutex);
+	int result = future->result;
+	pthread_mutex_unlock (&future->mutex);
+	return result;
+}
+
+void logdb_future_free (logdb_future* fut)
+{
+	logdb_future_t* future = (logdb_future_t*)fut;
+	DBGIF(!future) {
+		LOG("logdb_future_free: passed future was NULL");
+		return;
+	}
+	logdb_future_release (future);
+}
@@ -0,0 +1,47 @@
+#ifndef LOGDB_WRITER_H
+#define LOGDB_WRITER_H
+
+#include "logdb_internal.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+struct logdb_txn_t;
+
+/**
+ * Internal struct for the background thread that commits transactions passed
+ *  to `logdb_commit_async`. The thread is only started on the first async commit.
+ *
+ * Producers push onto `queue` without locking. The writer takes everything queued
+ *  so far in one atomic exchange, and only sleeps on `cond` once the queue is empty.
+ */
+typedef struct {
+	volatile _Atomic(struct logdb_txn_t*) queue; /**< lock-free stack of queued transactions, newest first */
+	volatile atomic_bool sleeping; /**< true while the writer is (about to be) waiting on `cond` */
+	volatile atomic_bool started; /**< true once `thread` has been started */
+	pthread_t thread;
+	pthread_mutex_t mutex; /**< protects the fields below, and used with `cond` */
+	pthread_cond_t cond; /**< signaled when transactions are queued while the writer is sleeping, or on stop */
+	bool running;
+	void* connection; /**< the `logdb_connection_t` that owns this writer */
+} logdb_writer_t;
+
+/**
+ * Initializes the given writer. This does not start the thread.
+ * \returns Zero (0) on success.
+ */
+int logdb_writer_init (logdb_writer_t* writer, void* connection);
+
+/**
+ * Queues the given outermost transaction to be committed by the writer, starting the writer thread if needed.
+ *  The transaction's `callback` and `context` must already be set.
+ * \returns Zero (0) on success.
+ */
+int logdb_writer_enqueue (logdb_writer_t* writer, struct logdb_txn_t* txn);
+
+/**
+ * Commits anything still queued, stops the writer thread if it was started, and frees the writer's resources.
+ */
+void logdb_writer_stop (logdb_writer_t* writer);
+
+#endif /* LOGDB_WRITER_H */
@@ -2,6 +2,7 @@
 #include "logdb.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <libgen.h>
 
 int main (int argc, char **argv) {
@@ -32,13 +33,15 @@ int main (int argc, char **argv) {
 		}
 
 		const char* k = (const char*)logdb_buffer_data (key);
-		const int* v = (const int*)logdb_buffer_data (val);
+		const void* v = logdb_buffer_data (val);
 		if (!k || !v) {
 			printf("logdb_buffer_data failed\n");
 			return 10;
 		}
 
-		printf("%s: %04d\n", k, *v);
+		int value;
+		(void)memcpy (&value, v, sizeof (value)); /* records may not be aligned for an int */
+		printf("%s: %04d\n", k, value);
 	}
 
 	logdb_iter_free (iter);
@@ -37,6 +37,7 @@ int main (int argc, char **argv) {
 		printf("\t\t\t  - Env var LOGDB_STRESS_KEY_PREFIX will override this. Suffix will have thread # unless LOGDB_STRESS_KEY_SUFFIX is set.\n");
 		printf("\t[threads]\tThe number of threads to create in this process\n");
 		printf("\t[count]\t\tThe number of iterations per thread\n");
+		printf("\nEnv var LOGDB_STRESS_OPEN_FLAGS may be set to extra `logdb_open_flags` (e.g. 4 for LOGDB_OPEN_SYNC_DATA).\n");
 		return 1;
 	}
 	
@@ -63,7 +64,8 @@ int main (int argc, char **argv) {
 		return 3;
 	}
 
-	conn = logdb_open (file, LOGDB_OPEN_CREATE);
+	const char* openflags = getenv("LOGDB_STRESS_OPEN_FLAGS");
+	conn = logdb_open (file, LOGDB_OPEN_CREATE | (openflags? atoi(openflags) : 0));
 	if (!conn) {
 		printf("logdb_open failed\n");
 		return 4;
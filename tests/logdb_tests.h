@@ -8,6 +8,10 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #define TEST(name) static int name () { printf("%s: ", #name);
 #define PASS printf(" pass!\n"); return 0; }
@@ -15,4 +19,192 @@
 #define ASSERTF(cond, fmt, ...) if(!(cond)) { printf(" FAIL!\n\nFailed `ASSERT(%s)` at %s:%d\n" fmt "\n", #cond, __FILE__, __LINE__, ##__VA_ARGS__); return (__COUNTER__ + 1); }
 #define ASSERT(cond) ASSERTF(cond, "")
 
+/* Number of threads and puts per thread for the concurrency tests */
+#define TEST_THREADS 8
+#define TEST_THREAD_PUTS 50
+
+/* Returns the int at the given address. Keys and values read back from the database may not be aligned for an int */
+static int test_int (const void* data)
+{
+	int value;
+	(void)memcpy (&value, data, sizeof (value));
+	return value;
+}
+
+/* Thread body for the concurrency tests. `arg` is the connection */
+static void* test_put_thread (void* arg)
+{
+	logdb_connection* conn = (logdb_connection*)arg;
+	for (int i = 0; i < TEST_THREAD_PUTS; i++) {
+		logdb_buffer* key = logdb_buffer_new_direct ("thread", 6, NULL);
+		logdb_buffer* val = logdb_buffer_new_copy (&i, sizeof (int));
+		int result = (key && val)? logdb_put (conn, key, val) : -1;
+		logdb_buffer_free (key);
+		logdb_buffer_free (val);
+		if (result != 0)
+			return (void*)1;
+	}
+	return NULL;
+}
+
+/* State for `test_put_and_exit_thread` */
+typedef struct {
+	logdb_connection* conn;
+	pthread_barrier_t* barrier; /* waited on after the put, right before the thread exits */
+} test_exit_t;
+
+/* Thread body for the sticky lease exit test. Puts once, so the thread holds a sticky lease, and then exits */
+static void* test_put_and_exit_thread (void* arg)
+{
+	test_exit_t* exit = (test_exit_t*)arg;
+	logdb_buffer* key = logdb_buffer_new_direct ("thread", 6, NULL);
+	logdb_buffer* val = logdb_buffer_new_direct ("exit", 4, NULL);
+	int result = (key && val)? logdb_put (exit->conn, key, val) : -1;
+	logdb_buffer_free (key);
+	logdb_buffer_free (val);
+	(void)pthread_barrier_wait (exit->barrier);
+	return result? (void*)1 : NULL;
+}
+
+/* Number of records written by the partitioned scan test */
+#define TEST_SCAN_PUTS 300
+
+/* State for `test_scan_thread` */
+typedef struct {
+	logdb_iter* iter;
+	int counts[TEST_SCAN_PUTS]; /* number of times each key was seen */
+} test_scan_t;
+
+/* Thread body for the partitioned scan test. `arg` is a `test_scan_t` */
+static void* test_scan_thread (void* arg)
+{
+	test_scan_t* scan = (test_scan_t*)arg;
+	while (logdb_iter_next (scan->iter)) {
+		logdb_buffer* key = logdb_iter_current_key (scan->iter);
+		if (!key || (logdb_buffer_length (key) != sizeof (int)))
+			return (void*)1;
+		int i;
+		(void)memcpy (&i, logdb_buffer_data (key), sizeof (int));
+		if ((i < 0) || (i >= TEST_SCAN_PUTS))
+			return (void*)1;
+		scan->counts[i]++;
+	}
+	return NULL;
+}
+
+/* Puts a record of the given size with key `i`, filled with 'a' + `i` */
+static int test_put_size (logdb_connection* conn, int i, size_t size)
+{
+	logdb_buffer *key, *val;
+	char* data;
+	ASSERT(data = malloc (size));
+	(void)memset (data, 'a' + i, size);
+	ASSERT(key = logdb_buffer_new_copy (&i, sizeof (int)));
+	ASSERT(val = logdb_buffer_new_direct (data, size, &free));
+	int result = logdb_put (conn, key, val);
+	logdb_buffer_free (key);
+	logdb_buffer_free (val);
+	return result;
+}
+
+/* Callback for `logdb_commit_async` that stores the result in the int pointed to by `context` */
+static void test_commit_callback (logdb_connection* connection, int result, void* context)
+{
+	(void)connection;
+	if (context)
+		*(int*)context = result;
+}
+
+/* Puts from several threads at once on a connection opened with the given flags,
+    then checks every put is there exactly once */
+static int test_concurrent_puts (logdb_open_flags flags)
+{
+	logdb_connection* conn;
+	ASSERT(conn = logdb_open("temp.logdb", flags));
+
+	pthread_t threads[TEST_THREADS];
+	for (int i = 0; i < TEST_THREADS; i++)
+		ASSERT(!pthread_create (&threads[i], NULL, &test_put_thread, conn));
+
+	for (int i = 0; i < TEST_THREADS; i++) {
+		void* result;
+		ASSERT(!pthread_join (threads[i], &result));
+		ASSERT(!result);
+	}
+
+	/* Every put from every thread should be there exactly once */
+	int counts[TEST_THREAD_PUTS] = { 0 };
+	int total = 0;
+	logdb_iter* iter;
+	ASSERT(iter = logdb_iter_all (conn));
+	while (logdb_iter_next (iter)) {
+		logdb_buffer* val;
+		const void* data;
+		ASSERT(val = logdb_iter_current_value (iter));
+		ASSERT(sizeof (int) == logdb_buffer_length (val));
+		ASSERT(data = logdb_buffer_data (val));
+		int i = test_int (data);
+		ASSERT((i >= 0) && (i < TEST_THREAD_PUTS));
+		counts[i]++;
+		total++;
+	}
+	logdb_iter_free (iter);
+
+	ASSERTF(total == (TEST_THREADS * TEST_THREAD_PUTS), "total: %d", total);
+	for (int i = 0; i < TEST_THREAD_PUTS; i++)
+		ASSERTF(counts[i] == TEST_THREADS, "counts[%d]: %d", i, counts[i]);
+
+	ASSERT(!logdb_close(conn));
+	unlink("temp.logdb");
+	return 0;
+}
+
+/* Iterates with an iterator from `create` over records written after it was created, on a connection
+    opened with the given flags, and checks that a value retained from the first record stays valid */
+static int test_iter_while_writing (logdb_iter* (*create)(logdb_connection*), logdb_open_flags flags)
+{
+	logdb_connection* conn;
+	ASSERT(conn = logdb_open_with_section_size("temp.logdb", flags, 4096));
+	ASSERT(!test_put_size (conn, 0, 100));
+
+	/* Records written after the iterator is created, including a span larger than the part of
+	    the file that was preallocated at the time, show up as it gets to them */
+	logdb_iter* iter;
+	ASSERT(iter = create (conn));
+	for (int i = 1; i < 200; i++)
+		ASSERT(!test_put_size (conn, i, (i == 150)? 10000000 : 100));
+
+	logdb_buffer* first = NULL;
+	char seen[200] = { 0 };
+	int count = 0;
+	while (logdb_iter_next (iter)) {
+		logdb_buffer *key, *val;
+		ASSERT(key = logdb_iter_current_key (iter));
+		ASSERT(sizeof (int) == logdb_buffer_length (key));
+		int i = test_int (logdb_buffer_data (key));
+		ASSERTF((i >= 0) && (i < 200) && !seen[i], "record: %d", i);
+		seen[i] = 1;
+		ASSERT(val = logdb_iter_current_value (iter));
+		ASSERTF(((i == 150)? 10000000 : 100) == logdb_buffer_length (val), "record: %d", i);
+		if (i == 0) {
+			first = val;
+			logdb_buffer_retain (first);
+		}
+		count++;
+	}
+	ASSERTF(count == 200, "count: %d", count);
+	logdb_iter_free (iter);
+
+	/* A retained value keeps the data it points to alive */
+	ASSERT(first);
+	ASSERT(100 == logdb_buffer_length (first));
+	const char* data = (const char*)logdb_buffer_data (first);
+	ASSERT((data[0] == 'a') && (data[99] == 'a'));
+	logdb_buffer_free (first);
+
+	ASSERT(!logdb_close(conn));
+	unlink("temp.logdb");
+	return 0;
+}
+
 #endif /* LOGDB_TESTS_H */
\ No newline at end of file